@@ -0,0 +1,54 @@
+#ifndef ACCEL_H
+#define ACCEL_H
+#include "vec3.hpp"
+#include "geometry.hpp"
+
+class Instance;
+class PrimStore;
+
+// Closest hit along a ray, naming the primitive by its reference in the 
+// store of the tree that found it. Primitives found inside an instance are 
+// in its object space, instance is NULL for ones placed directly in the 
+// world. u and v are the barycentric weights of the second and third 
+// corner of a triangle, everything else shading needs is worked out from 
+// them once the closest hit is known.
+class Hit
+{
+    public:
+        float t;
+        float u;
+        float v;
+        const PrimStore *store;
+        unsigned int prim;
+        const Instance *instance;
+        // A miss
+        Hit()
+        {
+            t = INFINITY;
+            u = 0;
+            v = 0;
+            store = NULL;
+            prim = 0;
+            instance = NULL;
+        }
+};
+
+// Acceleration structure over the scene primitives. The raytracer only 
+// talks to this interface so kd-trees and BVHs can be swapped at startup.
+class Accel
+{
+    public:
+        vec3 minBounds;
+        vec3 maxBounds;
+        virtual ~Accel() {}
+        // Closest primitive along the ray nearer than t_max, a miss if 
+        // there is none
+        virtual Hit intersect(vec3 origin, vec3 direction, 
+        float t_max = INFINITY) const = 0;
+        // True if any primitive is hit closer than max_dist
+        virtual bool occluded(vec3 origin, vec3 direction, 
+        float max_dist) const = 0;
+        // Brings the structure up to date after its primitives moved
+        virtual void update() = 0;
+};
+#endif
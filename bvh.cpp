@@ -0,0 +1,438 @@
+#include "bvh.hpp"
+#include <algorithm>
+
+BuildPrim build_prim(vec3 minBounds, vec3 maxBounds, unsigned int index)
+{
+    BuildPrim result;
+    result.minBounds = minBounds;
+    result.maxBounds = maxBounds;
+    result.centroid = .5 * (minBounds + maxBounds);
+    result.index = index;
+    return result;
+}
+
+void grow(vec3 &minBounds, vec3 &maxBounds, vec3 minAdd, vec3 maxAdd)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        minBounds.coord[i] = std::min(minBounds.coord[i], minAdd.coord[i]);
+        maxBounds.coord[i] = std::max(maxBounds.coord[i], maxAdd.coord[i]);
+    }
+}
+
+int bin_index(float centroid, float min_centroid, float scale)
+{
+    int result = (centroid - min_centroid) * scale;
+    return std::min(result, BVH_BINS - 1);
+}
+
+// Binned SAH from Wald, "On fast Construction of SAH-based Bounding Volume 
+// Hierarchies". Centroids are dropped into BVH_BINS bins per axis and the 
+// cheapest plane between two bins is used. Past half the stack size the 
+// build falls back to median splits so traversal can't overflow its stack.
+// Returns the index of the new node.
+unsigned int build_bvh(std::vector<BuildPrim> &prims, int start, int end, 
+int leaf_size, int depth, std::vector<BVHNode> &nodes)
+{
+    unsigned int index = nodes.size();
+    nodes.push_back(BVHNode());
+    vec3 minBounds = vec3(INFINITY, INFINITY, INFINITY);
+    vec3 maxBounds = -minBounds;
+    vec3 min_centroid = minBounds;
+    vec3 max_centroid = maxBounds;
+    for (int i = start; i < end; i++)
+    {
+        grow(minBounds, maxBounds, prims[i].minBounds, prims[i].maxBounds);
+        grow(min_centroid, max_centroid, prims[i].centroid, prims[i].centroid);
+    }
+    nodes[index].minBounds = minBounds;
+    nodes[index].maxBounds = maxBounds;
+    nodes[index].offset = start;
+    nodes[index].num_prims = end - start;
+    nodes[index].split_axis = 0;
+    int count = end - start;
+    if (count <= leaf_size)
+    {
+        return index;
+    }
+
+    int best_axis = -1;
+    int best_bin = 0;
+    float best_cost = INFINITY;
+    for (int axis = 0; axis < 3 && depth < BVH_STACK_SIZE / 2; axis++)
+    {
+        float extent = max_centroid.coord[axis] - min_centroid.coord[axis];
+        if (extent <= 0)
+        {
+            continue;
+        }
+        float scale = BVH_BINS / extent;
+        Bin bins[BVH_BINS];
+        for (int b = 0; b < BVH_BINS; b++)
+        {
+            bins[b].minBounds = vec3(INFINITY, INFINITY, INFINITY);
+            bins[b].maxBounds = -bins[b].minBounds;
+            bins[b].count = 0;
+        }
+        for (int i = start; i < end; i++)
+        {
+            int b = bin_index(prims[i].centroid.coord[axis], 
+            min_centroid.coord[axis], scale);
+            bins[b].count += 1;
+            grow(bins[b].minBounds, bins[b].maxBounds, prims[i].minBounds, 
+            prims[i].maxBounds);
+        }
+
+        // Area and count of everything right of each plane
+        float right_area[BVH_BINS - 1];
+        int right_count[BVH_BINS - 1];
+        vec3 rmin = vec3(INFINITY, INFINITY, INFINITY);
+        vec3 rmax = -rmin;
+        int num_right = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--)
+        {
+            grow(rmin, rmax, bins[b].minBounds, bins[b].maxBounds);
+            num_right += bins[b].count;
+            right_count[b - 1] = num_right;
+            right_area[b - 1] = num_right ? surface_area(rmin, rmax) : 0;
+        }
+
+        vec3 lmin = vec3(INFINITY, INFINITY, INFINITY);
+        vec3 lmax = -lmin;
+        int num_left = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++)
+        {
+            grow(lmin, lmax, bins[b].minBounds, bins[b].maxBounds);
+            num_left += bins[b].count;
+            if (num_left == 0 || right_count[b] == 0)
+            {
+                continue;
+            }
+            float cost = num_left * surface_area(lmin, lmax) + 
+            right_count[b] * right_area[b];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    int mid;
+    if (best_axis >= 0)
+    {
+        float split_cost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * 
+        best_cost / surface_area(minBounds, maxBounds);
+        if (split_cost >= BVH_INTERSECT_COST * count && count <= BVH_MAX_LEAF)
+        {
+            return index;
+        }
+        float min_c = min_centroid.coord[best_axis];
+        float scale = BVH_BINS / (max_centroid.coord[best_axis] - min_c);
+        int axis = best_axis;
+        int split_bin = best_bin;
+        mid = std::partition(prims.begin() + start, prims.begin() + end, 
+        [axis, split_bin, min_c, scale](const BuildPrim &p)
+        {
+            return bin_index(p.centroid.coord[axis], min_c, scale) <= 
+            split_bin;
+        }) - prims.begin();
+    }
+    else
+    {
+        // Centroids all coincide or the tree is too deep, split in half
+        best_axis = longest_axis(min_centroid, max_centroid);
+        mid = start + count / 2;
+        int axis = best_axis;
+        std::nth_element(prims.begin() + start, prims.begin() + mid, 
+        prims.begin() + end, [axis](const BuildPrim &l, const BuildPrim &r)
+        {
+            return l.centroid.coord[axis] < r.centroid.coord[axis];
+        });
+    }
+
+    nodes[index].num_prims = 0;
+    nodes[index].split_axis = best_axis;
+    build_bvh(prims, start, mid, leaf_size, depth + 1, nodes);
+    unsigned int right = build_bvh(prims, mid, end, leaf_size, depth + 1, 
+    nodes);
+    nodes[index].offset = right;
+    return index;
+}
+
+bvh::bvh(const std::vector<Shape*> &scenery, int leaf_size)
+    : bvh(PrimStore(scenery), leaf_size)
+{
+}
+
+bvh::bvh(const PrimStore &store, int leaf_size)
+{
+    this->leaf_size = leaf_size;
+    this->store = store;
+    std::vector<BuildPrim> prims;
+    prims.reserve(store.refs.size());
+    for (unsigned int i = 0; i < store.refs.size(); i++)
+    {
+        std::pair<vec3, vec3> bound = store.bounds(store.refs[i]);
+        prims.push_back(build_prim(bound.first, bound.second, i));
+    }
+    if (!prims.empty())
+    {
+        build_bvh(prims, 0, prims.size(), leaf_size, 0, nodes);
+        minBounds = nodes[0].minBounds;
+        maxBounds = nodes[0].maxBounds;
+    }
+    prim_refs.reserve(prims.size());
+    for (unsigned int i = 0; i < prims.size(); i++)
+    {
+        prim_refs.push_back(store.refs[prims[i].index]);
+    }
+    build_packs();
+    build_cost = bvh_cost(nodes);
+}
+
+// Orders the primitives of every leaf and packs them. The packs copy 
+// corners and centers, so they are built again whenever those move.
+void bvh::build_packs()
+{
+    packed.clear();
+    leaf_packs.assign(nodes.size(), LeafPacks());
+    for (unsigned int i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i].isLeaf())
+        {
+            leaf_packs[i] = packed.add(store, &prim_refs[nodes[i].offset], 
+            nodes[i].num_prims);
+        }
+    }
+}
+
+// Children always come after their parent, so walking the array backwards 
+// finishes both children before the node that contains them. prim_bounds 
+// is indexed like the leaf offsets.
+void refit_nodes(std::vector<BVHNode> &nodes, 
+const std::vector<std::pair<vec3, vec3>> &prim_bounds)
+{
+    for (int i = nodes.size() - 1; i >= 0; i--)
+    {
+        BVHNode &node = nodes[i];
+        node.minBounds = vec3(INFINITY, INFINITY, INFINITY);
+        node.maxBounds = -node.minBounds;
+        if (node.isLeaf())
+        {
+            for (unsigned int j = 0; j < node.num_prims; j++)
+            {
+                grow(node.minBounds, node.maxBounds, 
+                prim_bounds[node.offset + j].first, 
+                prim_bounds[node.offset + j].second);
+            }
+        }
+        else
+        {
+            grow(node.minBounds, node.maxBounds, nodes[i + 1].minBounds, 
+            nodes[i + 1].maxBounds);
+            grow(node.minBounds, node.maxBounds, nodes[node.offset].minBounds, 
+            nodes[node.offset].maxBounds);
+        }
+    }
+}
+
+// Expected cost of a random ray through the tree, each node weighted by 
+// the chance of hitting it given the root was hit
+float bvh_cost(const std::vector<BVHNode> &nodes)
+{
+    if (nodes.empty())
+    {
+        return 0;
+    }
+    float root_area = surface_area(nodes[0].minBounds, nodes[0].maxBounds);
+    if (root_area <= 0)
+    {
+        return 0;
+    }
+    float result = 0;
+    for (unsigned int i = 0; i < nodes.size(); i++)
+    {
+        float p = surface_area(nodes[i].minBounds, nodes[i].maxBounds) / 
+        root_area;
+        if (nodes[i].isLeaf())
+        {
+            result += p * BVH_INTERSECT_COST * nodes[i].num_prims;
+        }
+        else
+        {
+            result += p * BVH_TRAVERSAL_COST;
+        }
+    }
+    return result;
+}
+
+// Fits the boxes around primitives that moved, keeping the topology
+void bvh::refit()
+{
+    store.sync();
+    std::vector<std::pair<vec3, vec3>> prim_bounds;
+    prim_bounds.reserve(prim_refs.size());
+    for (unsigned int i = 0; i < prim_refs.size(); i++)
+    {
+        prim_bounds.push_back(store.bounds(prim_refs[i]));
+    }
+    refit_nodes(nodes, prim_bounds);
+    build_packs();
+    if (!nodes.empty())
+    {
+        minBounds = nodes[0].minBounds;
+        maxBounds = nodes[0].maxBounds;
+    }
+}
+
+// Refits, and rebuilds only once the old topology has gone bad
+void bvh::update()
+{
+    refit();
+    if (bvh_cost(nodes) > BVH_REBUILD_RATIO * build_cost)
+    {
+        *this = bvh(store, leaf_size);
+    }
+}
+
+// Slab test clipped to [0, t_max], t_near is where the ray enters the box. 
+// A ray lying in the plane of a face gets NaN for that axis, the min and 
+// max operand order makes it enter at t_a and leave at t_b, and the clamp 
+// to [0, t_max] drops it.
+bool box_hit(const BVHNode &n, vec4 origin, vec4 inv_dir, float t_max, 
+float &t_near)
+{
+    float4 t_a = (vec4::load(n.minBounds) - origin).comp_mul(inv_dir).v;
+    float4 t_b = (vec4::load(n.maxBounds) - origin).comp_mul(inv_dir).v;
+    float t0 = hmax3(max4(min4(t_b, t_a), float4(0.0f)));
+    float t1 = hmin3(min4(max4(t_a, t_b), float4(t_max)));
+    t_near = t0;
+    return t0 <= t1;
+}
+
+// Visits the nearer child first and only enters boxes closer than the 
+// best hit so far
+Hit bvh::intersect(vec3 origin, vec3 direction, float t_max) const
+{
+    Hit result;
+    vec4 inv_dir = vec4(direction).reciprocal();
+    vec4 ray_origin = vec4(origin);
+    float t_near;
+    if (nodes.empty() || 
+    !box_hit(nodes[0], ray_origin, inv_dir, t_max, t_near))
+    {
+        return result;
+    }
+    result.t = t_max;
+    Ray ray(origin, direction);
+    unsigned int s[BVH_STACK_SIZE];
+    int stack_size = 0;
+    unsigned int n = 0;
+    while (true)
+    {
+        const BVHNode &node = nodes[n];
+        if (node.isLeaf())
+        {
+            leaf_intersection(packed, leaf_packs[n], store, 
+            &prim_refs[node.offset], node.num_prims, ray, result);
+        }
+        else
+        {
+            unsigned int near = n + 1;
+            unsigned int far = node.offset;
+            float t_left;
+            float t_right;
+            bool hit_left = box_hit(nodes[near], ray_origin, inv_dir, 
+            result.t, t_left);
+            bool hit_right = box_hit(nodes[far], ray_origin, inv_dir, 
+            result.t, t_right);
+            if (hit_left && hit_right)
+            {
+                if (t_right < t_left)
+                {
+                    std::swap(near, far);
+                }
+                s[stack_size] = far;
+                stack_size++;
+                n = near;
+                continue;
+            }
+            else if (hit_left)
+            {
+                n = near;
+                continue;
+            }
+            else if (hit_right)
+            {
+                n = far;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+        {
+            return result.t < t_max ? result : Hit();
+        }
+        stack_size--;
+        n = s[stack_size];
+    }
+}
+
+bool bvh::occluded(vec3 origin, vec3 direction, float max_dist) const
+{
+    vec4 inv_dir = vec4(direction).reciprocal();
+    vec4 ray_origin = vec4(origin);
+    float t_near;
+    if (nodes.empty() || 
+    !box_hit(nodes[0], ray_origin, inv_dir, max_dist, t_near))
+    {
+        return false;
+    }
+    Ray ray(origin, direction);
+    unsigned int s[BVH_STACK_SIZE];
+    int stack_size = 0;
+    unsigned int n = 0;
+    while (true)
+    {
+        const BVHNode &node = nodes[n];
+        if (node.isLeaf())
+        {
+            if (leaf_occluded(packed, leaf_packs[n], store, 
+            &prim_refs[node.offset], node.num_prims, ray, max_dist))
+            {
+                return true;
+            }
+        }
+        else
+        {
+            bool hit_left = box_hit(nodes[n + 1], ray_origin, inv_dir, 
+            max_dist, t_near);
+            bool hit_right = box_hit(nodes[node.offset], ray_origin, inv_dir, 
+            max_dist, t_near);
+            if (hit_left && hit_right)
+            {
+                s[stack_size] = node.offset;
+                stack_size++;
+                n = n + 1;
+                continue;
+            }
+            else if (hit_left)
+            {
+                n = n + 1;
+                continue;
+            }
+            else if (hit_right)
+            {
+                n = node.offset;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+        {
+            return false;
+        }
+        stack_size--;
+        n = s[stack_size];
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef BVH_H
+#define BVH_H
+#include <vector>
+#include "vec3.hpp"
+#include "vec4.hpp"
+#include "geometry.hpp"
+#include "accel.hpp"
+#include "prim_store.hpp"
+#include "leaf_packs.hpp"
+#define BVH_BINS 16
+#define BVH_TRAVERSAL_COST 1.0
+#define BVH_INTERSECT_COST 1.5
+#define BVH_STACK_SIZE 64
+// Largest leaf the SAH may keep when splitting further doesn't pay off
+#define BVH_MAX_LEAF 32
+// Refitted trees are rebuilt once their SAH cost grows past this factor of 
+// the cost they were built with
+#define BVH_REBUILD_RATIO 1.5
+
+// Interior nodes keep the left child right after them and the right child 
+// at offset. Leaves hold num_prims primitives starting at offset.
+class BVHNode
+{
+    public:
+        vec3 minBounds;
+        vec3 maxBounds;
+        unsigned int offset;
+        unsigned short num_prims;
+        unsigned short split_axis;
+        bool isLeaf() const
+        {
+            return num_prims > 0;
+        }
+};
+
+// Bounds of one primitive during the build, index refers to the input
+class BuildPrim
+{
+    public:
+        vec3 minBounds;
+        vec3 maxBounds;
+        vec3 centroid;
+        unsigned int index;
+};
+
+class Bin
+{
+    public:
+        vec3 minBounds;
+        vec3 maxBounds;
+        int count;
+};
+
+class bvh: public Accel
+{
+    public:
+        int leaf_size;
+        PrimStore store;
+        // Reordered so every leaf is a contiguous range
+        std::vector<unsigned int> prim_refs;
+        std::vector<BVHNode> nodes;
+        PackedLeaves packed;
+        // Indexed like nodes, only leaves use theirs
+        std::vector<LeafPacks> leaf_packs;
+        float build_cost;
+        bvh(const std::vector<Shape*> &scenery, int leaf_size);
+        bvh(const PrimStore &store, int leaf_size);
+        Hit intersect(vec3 origin, vec3 direction, 
+        float t_max = INFINITY) const;
+        bool occluded(vec3 origin, vec3 direction, float max_dist) const;
+        void update();
+        void refit();
+        void build_packs();
+};
+
+BuildPrim build_prim(vec3 minBounds, vec3 maxBounds, unsigned int index);
+
+void grow(vec3 &minBounds, vec3 &maxBounds, vec3 minAdd, vec3 maxAdd);
+
+unsigned int build_bvh(std::vector<BuildPrim> &prims, int start, int end, 
+int leaf_size, int depth, std::vector<BVHNode> &nodes);
+
+void refit_nodes(std::vector<BVHNode> &nodes, 
+const std::vector<std::pair<vec3, vec3>> &prim_bounds);
+
+float bvh_cost(const std::vector<BVHNode> &nodes);
+
+bool box_hit(const BVHNode &n, vec4 origin, vec4 inv_dir, float t_max, 
+float &t_near);
+#endif
@@ -0,0 +1,348 @@
+#include "bvh4.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <utility>
+
+// Opens the interior node with the largest surface area until there are 
+// four children, then recurses on the interior nodes left over. Leaves 
+// keep the packs the binary tree built for them. Returns the index of the 
+// new node.
+unsigned int collapse(const bvh &binary_tree, unsigned int n, 
+std::vector<BVH4Node> &nodes, std::vector<BVH4Leaf> &leaves)
+{
+    const std::vector<BVHNode> &binary = binary_tree.nodes;
+    unsigned int kids[4] = {n, 0, 0, 0};
+    int num_kids = 1;
+    while (num_kids < 4)
+    {
+        int best = -1;
+        float best_area = -1;
+        for (int i = 0; i < num_kids; i++)
+        {
+            const BVHNode &kid = binary[kids[i]];
+            float area = surface_area(kid.minBounds, kid.maxBounds);
+            if (!kid.isLeaf() && area > best_area)
+            {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        unsigned int opened = kids[best];
+        kids[best] = opened + 1;
+        kids[num_kids] = binary[opened].offset;
+        num_kids++;
+    }
+
+    unsigned int index = nodes.size();
+    nodes.push_back(BVH4Node());
+    for (int i = 0; i < 4; i++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            nodes[index].bounds[k][i] = INFINITY;
+            nodes[index].bounds[k + 3][i] = -INFINITY;
+        }
+        nodes[index].child[i] = 0;
+        nodes[index].count[i] = 0;
+    }
+    for (int i = 0; i < num_kids; i++)
+    {
+        const BVHNode &kid = binary[kids[i]];
+        for (int k = 0; k < 3; k++)
+        {
+            nodes[index].bounds[k][i] = kid.minBounds.coord[k];
+            nodes[index].bounds[k + 3][i] = kid.maxBounds.coord[k];
+        }
+        if (kid.isLeaf())
+        {
+            BVH4Leaf leaf;
+            leaf.first = kid.offset;
+            leaf.count = kid.num_prims;
+            leaf.packs = binary_tree.leaf_packs[kids[i]];
+            nodes[index].child[i] = leaves.size();
+            nodes[index].count[i] = kid.num_prims;
+            leaves.push_back(leaf);
+        }
+        else
+        {
+            unsigned int child = collapse(binary_tree, kids[i], nodes, leaves);
+            nodes[index].child[i] = child;
+        }
+    }
+    return index;
+}
+
+bvh4::bvh4(const std::vector<Shape*> &scenery, int leaf_size)
+    : bvh4(PrimStore(scenery), leaf_size)
+{
+}
+
+bvh4::bvh4(const PrimStore &store, int leaf_size)
+{
+    bvh binary(store, leaf_size);
+    this->leaf_size = leaf_size;
+    minBounds = binary.minBounds;
+    maxBounds = binary.maxBounds;
+    this->store = std::move(binary.store);
+    prim_refs = std::move(binary.prim_refs);
+    if (!binary.nodes.empty())
+    {
+        collapse(binary, 0, nodes, leaves);
+    }
+    packed = std::move(binary.packed);
+    build_cost = bvh4_cost(*this);
+}
+
+// Refits every child box of node n from the primitives below it and 
+// returns the bounds of the whole node. Unused slots keep their empty box.
+std::pair<vec3, vec3> refit_node(bvh4 &t, unsigned int n)
+{
+    std::pair<vec3, vec3> result;
+    result.first = vec3(INFINITY, INFINITY, INFINITY);
+    result.second = -result.first;
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned int child = t.nodes[n].child[i];
+        unsigned int count = t.nodes[n].count[i];
+        if (count == 0 && child == 0)
+        {
+            continue;
+        }
+        std::pair<vec3, vec3> bound;
+        if (count > 0)
+        {
+            bound.first = vec3(INFINITY, INFINITY, INFINITY);
+            bound.second = -bound.first;
+            const BVH4Leaf &leaf = t.leaves[child];
+            for (unsigned int j = 0; j < count; j++)
+            {
+                std::pair<vec3, vec3> prim = 
+                t.store.bounds(t.prim_refs[leaf.first + j]);
+                grow(bound.first, bound.second, prim.first, prim.second);
+            }
+        }
+        else
+        {
+            bound = refit_node(t, child);
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            t.nodes[n].bounds[k][i] = bound.first.coord[k];
+            t.nodes[n].bounds[k + 3][i] = bound.second.coord[k];
+        }
+        grow(result.first, result.second, bound.first, bound.second);
+    }
+    return result;
+}
+
+// Same measure as bvh_cost, summed over the child slots
+float bvh4_cost(const bvh4 &t)
+{
+    float root_area = surface_area(t.minBounds, t.maxBounds);
+    if (t.nodes.empty() || root_area <= 0)
+    {
+        return 0;
+    }
+    float result = BVH_TRAVERSAL_COST;
+    for (unsigned int n = 0; n < t.nodes.size(); n++)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            const BVH4Node &node = t.nodes[n];
+            if (node.count[i] == 0 && node.child[i] == 0)
+            {
+                continue;
+            }
+            float p = surface_area(
+            vec3(node.bounds[0][i], node.bounds[1][i], node.bounds[2][i]), 
+            vec3(node.bounds[3][i], node.bounds[4][i], node.bounds[5][i])) / 
+            root_area;
+            if (node.count[i] > 0)
+            {
+                result += p * BVH_INTERSECT_COST * node.count[i];
+            }
+            else
+            {
+                result += p * BVH_TRAVERSAL_COST;
+            }
+        }
+    }
+    return result;
+}
+
+// The packs copy corners and centers, so they are built again too
+void bvh4::refit()
+{
+    store.sync();
+    if (!nodes.empty())
+    {
+        std::pair<vec3, vec3> bound = refit_node(*this, 0);
+        minBounds = bound.first;
+        maxBounds = bound.second;
+    }
+    packed.clear();
+    for (unsigned int i = 0; i < leaves.size(); i++)
+    {
+        leaves[i].packs = packed.add(store, &prim_refs[leaves[i].first], 
+        leaves[i].count);
+    }
+}
+
+// Refits, and rebuilds only once the old topology has gone bad
+void bvh4::update()
+{
+    refit();
+    if (bvh4_cost(*this) > BVH_REBUILD_RATIO * build_cost)
+    {
+        *this = bvh4(store, leaf_size);
+    }
+}
+
+// Slab test of all four children at once, clipped to [0, t_max]. Near and 
+// far planes are picked per axis from the sign of the direction. Returns a 
+// bit per child that was hit and writes the entry distances.
+int box_hit4(const BVH4Node &n, vec3 origin, vec3 inv_dir, float t_max, 
+float *t_near)
+{
+    float4 t0 = float4(0.0f);
+    float4 t1 = float4(t_max);
+    for (int k = 0; k < 3; k++)
+    {
+        int near_row = inv_dir.coord[k] >= 0 ? k : k + 3;
+        int far_row = inv_dir.coord[k] >= 0 ? k + 3 : k;
+        float4 o = float4(origin.coord[k]);
+        float4 inv = float4(inv_dir.coord[k]);
+        float4 t_a = (float4::load(n.bounds[near_row]) - o) * inv;
+        float4 t_b = (float4::load(n.bounds[far_row]) - o) * inv;
+        t0 = max4(t_a, t0);
+        t1 = min4(t_b, t1);
+    }
+    t0.store(t_near);
+    return movemask(t0 <= t1);
+}
+
+// The nearest hit child is visited next and the rest are pushed farthest 
+// first. Entries that start past the best hit found since they were pushed 
+// are dropped when popped.
+Hit bvh4::intersect(vec3 origin, vec3 direction, float t_max) const
+{
+    Hit result;
+    if (nodes.empty())
+    {
+        return result;
+    }
+    vec3 inv_dir = vec3(1.0 / direction.coord[0], 1.0 / direction.coord[1], 
+    1.0 / direction.coord[2]);
+    result.t = t_max;
+    Ray ray(origin, direction);
+    BVH4Stack s[BVH4_STACK_SIZE];
+    int stack_size = 0;
+    BVH4Stack current;
+    current.child = 0;
+    current.count = 0;
+    current.t_near = 0;
+    while (true)
+    {
+        if (current.count > 0)
+        {
+            const BVH4Leaf &leaf = leaves[current.child];
+            leaf_intersection(packed, leaf.packs, store, 
+            &prim_refs[leaf.first], leaf.count, ray, result);
+        }
+        else
+        {
+            const BVH4Node &node = nodes[current.child];
+            float t_near[4];
+            int mask = box_hit4(node, origin, inv_dir, result.t, t_near);
+            int order[4];
+            int num_hit = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                if (mask & (1 << i))
+                {
+                    // Insertion sort by descending entry distance
+                    int j = num_hit;
+                    while (j > 0 && t_near[order[j - 1]] < t_near[i])
+                    {
+                        order[j] = order[j - 1];
+                        j--;
+                    }
+                    order[j] = i;
+                    num_hit++;
+                }
+            }
+            if (num_hit > 0)
+            {
+                for (int i = 0; i < num_hit - 1; i++)
+                {
+                    s[stack_size].child = node.child[order[i]];
+                    s[stack_size].count = node.count[order[i]];
+                    s[stack_size].t_near = t_near[order[i]];
+                    stack_size++;
+                }
+                current.child = node.child[order[num_hit - 1]];
+                current.count = node.count[order[num_hit - 1]];
+                continue;
+            }
+        }
+
+        do
+        {
+            if (stack_size == 0)
+            {
+                return result.t < t_max ? result : Hit();
+            }
+            stack_size--;
+        }
+        while (s[stack_size].t_near > result.t);
+        current = s[stack_size];
+    }
+}
+
+bool bvh4::occluded(vec3 origin, vec3 direction, float max_dist) const
+{
+    if (nodes.empty())
+    {
+        return false;
+    }
+    vec3 inv_dir = vec3(1.0 / direction.coord[0], 1.0 / direction.coord[1], 
+    1.0 / direction.coord[2]);
+    Ray ray(origin, direction);
+    BVH4Stack s[BVH4_STACK_SIZE];
+    s[0].child = 0;
+    s[0].count = 0;
+    int stack_size = 1;
+    while (stack_size > 0)
+    {
+        stack_size--;
+        BVH4Stack popped = s[stack_size];
+        if (popped.count > 0)
+        {
+            const BVH4Leaf &leaf = leaves[popped.child];
+            if (leaf_occluded(packed, leaf.packs, store, 
+            &prim_refs[leaf.first], leaf.count, ray, max_dist))
+            {
+                return true;
+            }
+            continue;
+        }
+
+        const BVH4Node &node = nodes[popped.child];
+        float t_near[4];
+        int mask = box_hit4(node, origin, inv_dir, max_dist, t_near);
+        for (int i = 0; i < 4; i++)
+        {
+            if (mask & (1 << i))
+            {
+                s[stack_size].child = node.child[i];
+                s[stack_size].count = node.count[i];
+                stack_size++;
+            }
+        }
+    }
+    return false;
+}
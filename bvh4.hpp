@@ -0,0 +1,69 @@
+#ifndef BVH4_H
+#define BVH4_H
+#include <vector>
+#include "vec3.hpp"
+#include "geometry.hpp"
+#include "accel.hpp"
+#include "bvh.hpp"
+// Every level of a BVH4 pushes at most three children
+#define BVH4_STACK_SIZE (3 * BVH_STACK_SIZE)
+
+// Four children with their boxes stored SoA so one SIMD slab test covers 
+// all of them. Rows of bounds are min x, y, z then max x, y, z. A child 
+// with count > 0 is a leaf of count primitives and child indexes the 
+// tree's leaves, otherwise child is a node index. Unused slots have empty 
+// boxes that never get hit.
+class BVH4Node
+{
+    public:
+        float bounds[6][4];
+        unsigned int child[4];
+        unsigned int count[4];
+};
+
+// Leaf of count primitives starting at first in prim_refs
+class BVH4Leaf
+{
+    public:
+        unsigned int first;
+        unsigned int count;
+        LeafPacks packs;
+};
+
+class BVH4Stack
+{
+    public:
+        unsigned int child;
+        unsigned int count;
+        float t_near;
+};
+
+class bvh4: public Accel
+{
+    public:
+        int leaf_size;
+        PrimStore store;
+        std::vector<unsigned int> prim_refs;
+        std::vector<BVH4Node> nodes;
+        std::vector<BVH4Leaf> leaves;
+        PackedLeaves packed;
+        float build_cost;
+        bvh4(const std::vector<Shape*> &scenery, int leaf_size);
+        bvh4(const PrimStore &store, int leaf_size);
+        Hit intersect(vec3 origin, vec3 direction, 
+        float t_max = INFINITY) const;
+        bool occluded(vec3 origin, vec3 direction, float max_dist) const;
+        void update();
+        void refit();
+};
+
+unsigned int collapse(const bvh &binary, unsigned int n, 
+std::vector<BVH4Node> &nodes, std::vector<BVH4Leaf> &leaves);
+
+std::pair<vec3, vec3> refit_node(bvh4 &t, unsigned int n);
+
+float bvh4_cost(const bvh4 &t);
+
+int box_hit4(const BVH4Node &n, vec3 origin, vec3 inv_dir, float t_max, 
+float *t_near);
+#endif
@@ -1,42 +1,346 @@
 #include "drawer.hpp"
+#include "vec4.hpp"
+#include <algorithm>
+#include <atomic>
 
-void draw(const kdtree &t, std::vector<Light> &lights, vec3 eye, vec3 center, 
-vec3 up, int rows, int cols, float ior, int depth, float bias, float fov, 
-std::string filename, float rgb[HEIGHT][WIDTH][3])
+// Offset in [0, 1) picked by hashing its arguments, so a pass samples the 
+// same points however its tiles are spread over threads
+float jitter(unsigned int a, unsigned int b, unsigned int c)
 {
-    float total = HEIGHT * WIDTH;
-    float *mat = lookAtMatrix(eye, center, up);
-    
-    # pragma omp parallel for
-    for (int i = 0; i < rows; i++)
+    unsigned int h = a * 0x9e3779b1u ^ b * 0x85ebca77u ^ c * 0xc2b2ae3du;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.0f / (1 << 24));
+}
+
+float luminance(vec3 color)
+{
+    return .2126 * color.coord[0] + .7152 * color.coord[1] + 
+    .0722 * color.coord[2];
+}
+
+SampleSums::SampleSums(int width, int height)
+{
+    this->width = width;
+    sum.resize(width * height);
+    luminance_sq.resize(width * height);
+    count.resize(width * height);
+}
+
+void SampleSums::add(int row, int col, vec3 color)
+{
+    int p = row * width + col;
+    sum[p] += color;
+    float l = luminance(color);
+    luminance_sq[p] += l * l;
+    count[p]++;
+}
+
+vec3 SampleSums::mean(int row, int col) const
+{
+    int p = row * width + col;
+    return (1.0 / count[p]) * sum[p];
+}
+
+float SampleSums::noise() const
+{
+    double total = 0;
+    for (unsigned int p = 0; p < count.size(); p++)
     {
-        for (int j = 0; j < cols; j++)
+        float n = count[p];
+        if (n < 2)
         {
-            std::cout << 100. * float(i * WIDTH + j) / total << 
-            "% done" << std::endl;
-            vec3 new_point = lookAt(mat, primary(i, j, FOV));
-            vec3 new_dir = new_point.normalize();
-            vec3 color = caster(eye, new_dir, t, lights, depth);
-            for (int k = 0; k < 3; k++)
-            {
-                rgb[i][j][k] = color.coord[k];
-            }
+            return INFINITY;
         }
+        float mean = luminance(sum[p]) / n;
+        float variance = (luminance_sq[p] / n - mean * mean) * n / (n - 1);
+        total += sqrt(std::max(variance, 0.0f) / n);
     }
-    delete mat;
+    return total / count.size();
+}
 
-    std::ofstream file(filename + ".txt");
+bool differ(const Sample &left, const Sample &right)
+{
+    if (left.store != right.store || left.prim != right.prim || 
+    left.instance != right.instance)
+    {
+        return true;
+    }
     for (int k = 0; k < 3; k++)
     {
-        for (int i = 0; i < rows; i++)
+        if (fabs(left.color.coord[k] - right.color.coord[k]) > AA_CONTRAST)
         {
-            for (int j = 0; j < cols; j++)
+            return true;
+        }
+    }
+    return false;
+}
+
+vec3 View::trace(float y, float x, int width, int height) const
+{
+    vec3 new_point = lookAt(mat, primary(y, x, width, height, fov));
+    vec3 new_dir = vec4(new_point).normalize().xyz();
+    return caster(eye, new_dir, *t, *lights, depth);
+}
+
+Sample View::sample(float y, float x, int width, int height) const
+{
+    vec3 new_point = lookAt(mat, primary(y, x, width, height, fov));
+    vec3 new_dir = vec4(new_point).normalize().xyz();
+    Hit hit;
+    Sample result;
+    result.color = caster(eye, new_dir, *t, *lights, depth, &hit);
+    result.store = hit.store;
+    result.prim = hit.prim;
+    result.instance = hit.instance;
+    return result;
+}
+
+vec3 subdivide(const View &view, float y, float x, float size, 
+const Sample &center, int levels, int width, int height, long long &rays)
+{
+    if (levels == 0)
+    {
+        return center.color;
+    }
+    float half = size / 2;
+    Sample quarters[4];
+    bool edge = false;
+    for (int q = 0; q < 4; q++)
+    {
+        quarters[q] = view.sample(y + (q / 2 + .5) * half, 
+        x + (q % 2 + .5) * half, width, height);
+        edge = edge || differ(quarters[q], center);
+    }
+    rays += 4;
+    vec3 result;
+    for (int q = 0; q < 4; q++)
+    {
+        result += edge ? subdivide(view, y + q / 2 * half, x + q % 2 * half, 
+        half, quarters[q], levels - 1, width, height, rays) : 
+        quarters[q].color;
+    }
+    return .25 * result;
+}
+
+// The screen is cut into tiles handed out one at a time, so threads that 
+// finish cheap tiles take more of them and slow mirror and glass regions 
+// spread over every core. Threads only share the tile schedule and one 
+// counter of finished pixels, whichever thread finishes a tile after the 
+// report is due prints the progress.
+long long render_pass(const View &view, const Pass &pass, Framebuffer &frame, 
+SampleSums *sums)
+{
+    long long rays = 0;
+    int rows = frame.height;
+    int cols = frame.width;
+    float total = rows * cols;
+    int tile_width = frame.span_width(TILE_SIZE);
+    int tile_cols = (cols + tile_width - 1) / tile_width;
+    int tile_rows = (rows + TILE_SIZE - 1) / TILE_SIZE;
+    std::vector<int> band_tiles(tile_rows, 0);
+    int next_band = 0;
+    std::atomic<int> pixels_done(0);
+    render_clock::duration interval = 
+    std::chrono::duration_cast<render_clock::duration>( 
+    std::chrono::duration<double>(PROGRESS_INTERVAL));
+    std::atomic<render_clock::rep> next_report((render_clock::now() + 
+    interval).time_since_epoch().count());
+
+    # pragma omp parallel for schedule(dynamic) reduction(+:rays)
+    for (int tile = 0; tile < tile_rows * tile_cols; tile++)
+    {
+        if (render_clock::now() >= pass.deadline)
+        {
+            continue;
+        }
+        int row_start = tile / tile_cols * TILE_SIZE;
+        int col_start = tile % tile_cols * tile_width;
+        int row_end = std::min(row_start + TILE_SIZE, rows);
+        int col_end = std::min(col_start + tile_width, cols);
+        int step = pass.type == COARSE_PASS ? pass.step : 1;
+        for (int i = row_start; i < row_end; i += step)
+        {
+            for (int j = col_start; j < col_end; j += step)
+            {
+                if (pass.type == JITTER_PASS)
+                {
+                    vec3 color = view.trace(i + jitter(i, j, 2 * pass.index), 
+                    j + jitter(i, j, 2 * pass.index + 1), cols, rows);
+                    rays++;
+                    sums->add(i, j, color);
+                    frame.set(i, j, sums->mean(i, j));
+                    continue;
+                }
+                if (pass.type == ADAPTIVE_PASS)
+                {
+                    const Sample *around = &(*pass.centers)[i * cols + j];
+                    const Sample &middle = around[0];
+                    if ((i > 0 && differ(middle, around[-cols])) || 
+                    (i + 1 < rows && differ(middle, around[cols])) || 
+                    (j > 0 && differ(middle, around[-1])) || 
+                    (j + 1 < cols && differ(middle, around[1])))
+                    {
+                        frame.set(i, j, subdivide(view, i, j, 1, middle, 
+                        pass.levels, cols, rows, rays));
+                    }
+                    continue;
+                }
+                if (pass.coarser && i % pass.coarser == 0 && 
+                j % pass.coarser == 0)
+                {
+                    continue;
+                }
+                vec3 color;
+                if (pass.centers)
+                {
+                    Sample center = view.sample(i + .5, j + .5, cols, rows);
+                    (*pass.centers)[i * cols + j] = center;
+                    color = center.color;
+                }
+                else
+                {
+                    color = view.trace(i + .5, j + .5, cols, rows);
+                }
+                rays++;
+                if (sums)
+                {
+                    sums->add(i, j, color);
+                }
+                for (int y = i; y < std::min(i + step, rows); y++)
+                {
+                    for (int x = j; x < std::min(j + step, cols); x++)
+                    {
+                        frame.set(y, x, color);
+                    }
+                }
+            }
+        }
+        if (pass.writer)
+        {
+            # pragma omp critical(image_output)
             {
-                file << rgb[i][j][k] << " ";
+                band_tiles[tile / tile_cols]++;
+                while (next_band < tile_rows && 
+                band_tiles[next_band] == tile_cols)
+                {
+                    int first = next_band * TILE_SIZE;
+                    pass.writer->write_rows(frame, first, 
+                    std::min(TILE_SIZE, rows - first));
+                    next_band++;
+                }
             }
-            file << std::endl;
         }
-        file << std::endl;
+        int done = pixels_done += (row_end - row_start) * 
+        (col_end - col_start);
+        render_clock::rep now = render_clock::now().time_since_epoch().count();
+        render_clock::rep due = next_report;
+        if (now >= due && 
+        next_report.compare_exchange_strong(due, now + interval.count()))
+        {
+            std::cout << 100. * done / total << "% done" << std::endl;
+        }
+    }
+    return rays;
+}
+
+// Without a budget every pixel center is traced once, and the image is 
+// streamed out as it renders. With aa_levels, pixels on edges are then 
+// split into quarters up to aa_levels times, where their samples still 
+// differ, and the image streams out of that pass. A progressive render 
+// starts with a pass over 8 x 8 blocks, halves the blocks until every 
+// pixel has its center traced and then adds a jittered sample per pixel 
+// each pass, until the time is up, the noise is low enough or max_samples 
+// is reached. Stopping part way through a pass still leaves every pixel 
+// with a color. The image is written once at the end.
+void draw(const Accel &t, std::vector<Light> &lights, vec3 eye, vec3 center, 
+vec3 up, float ior, int depth, float bias, float fov, std::string filename, 
+Framebuffer &frame, const RenderBudget &budget, int aa_levels)
+{
+    int rows = frame.height;
+    int cols = frame.width;
+    std::shared_ptr<ImageWriter> writer = open_image(filename, cols, rows);
+    if (!writer)
+    {
+        std::cerr << "Could not write " << filename << std::endl;
+        return;
+    }
+    View view;
+    view.t = &t;
+    view.lights = &lights;
+    view.eye = eye;
+    view.mat = lookAtMatrix(eye, center, up);
+    view.fov = fov;
+    view.depth = depth;
+    if (!budget.progressive() && aa_levels == 0)
+    {
+        Pass pass;
+        pass.writer = writer.get();
+        render_pass(view, pass, frame, NULL);
+    }
+    else if (!budget.progressive())
+    {
+        std::vector<Sample> centers(rows * cols);
+        Pass pass;
+        pass.centers = &centers;
+        long long rays = render_pass(view, pass, frame, NULL);
+        pass.type = ADAPTIVE_PASS;
+        pass.levels = aa_levels;
+        pass.writer = writer.get();
+        rays += render_pass(view, pass, frame, NULL);
+        // Uniform supersampling as fine as the deepest split
+        long long uniform = (long long) rows * cols << (2 * aa_levels);
+        std::cout << "Adaptive anti-aliasing traced " << rays << 
+        " primary rays, uniform " << (1 << aa_levels) << "x" << 
+        (1 << aa_levels) << " supersampling traces " << uniform << 
+        ", saving " << 100. * (uniform - rays) / uniform << "%" << std::endl;
+    }
+    else
+    {
+        render_clock::time_point start = render_clock::now();
+        render_clock::time_point deadline = render_clock::time_point::max();
+        if (budget.seconds > 0)
+        {
+            deadline = start + std::chrono::duration_cast< 
+            render_clock::duration>(std::chrono::duration<double>( 
+            budget.seconds));
+        }
+        SampleSums sums(cols, rows);
+        // The first pass always completes, so there is a whole image
+        Pass pass;
+        pass.step = COARSE_STEP;
+        render_pass(view, pass, frame, &sums);
+        pass.deadline = deadline;
+        for (int step = COARSE_STEP / 2; step >= 1; step /= 2)
+        {
+            pass.step = step;
+            pass.coarser = 2 * step;
+            render_pass(view, pass, frame, &sums);
+        }
+        pass.type = JITTER_PASS;
+        int samples = 1;
+        float noise = sums.noise();
+        while (samples < budget.max_samples && 
+        render_clock::now() < deadline && noise > budget.noise)
+        {
+            pass.index = samples;
+            render_pass(view, pass, frame, &sums);
+            samples++;
+            noise = sums.noise();
+        }
+        std::chrono::duration<float> render_time = render_clock::now() - 
+        start;
+        std::cout << "Rendered up to " << samples << 
+        " samples per pixel in " << render_time.count() << "s, noise " << 
+        noise << std::endl;
+        writer->write_rows(frame, 0, rows);
+    }
+    delete[] view.mat;
+    if (!writer->finish())
+    {
+        std::cerr << "Could not write " << filename << std::endl;
     }
-    file.close();
 }
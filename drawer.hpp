@@ -3,12 +3,142 @@
 #include "geometry.hpp"
 #include "vec3.hpp"
 #include "raytracer.hpp"
-#include "kdtree.hpp"
+#include "accel.hpp"
+#include "framebuffer.hpp"
+#include "image_writer.hpp"
 #include <vector>
 #include <string>
+#include <chrono>
 #include<fstream>
+// Height of the screen tiles threads take one at a time. Tiles are at least 
+// as wide, and wider where that keeps them on separate cache lines.
+#define TILE_SIZE 16
+// Seconds between progress reports
+#define PROGRESS_INTERVAL 1.0
+// The first progressive pass traces one pixel of every block this wide
+#define COARSE_STEP 8
+// Samples further apart than this in any channel mark an edge for adaptive 
+// anti-aliasing
+#define AA_CONTRAST .1
 
-void draw(const kdtree &t, std::vector<Light> &lights, vec3 eye, vec3 center, 
-vec3 up, int rows, int cols, float ior, int depth, float bias, float fov, 
-std::string filename, float rgb[HEIGHT][WIDTH][3]);
+typedef std::chrono::steady_clock render_clock;
+
+// When a progressive render stops. With neither a time nor a noise target 
+// the render is a single pass of one ray through every pixel center.
+class RenderBudget
+{
+    public:
+        // Wall clock seconds, 0 for no limit
+        float seconds;
+        // Mean standard error of the pixel luminances, 0 for no target
+        float noise;
+        int max_samples;
+        RenderBudget()
+        {
+            seconds = 0;
+            noise = 0;
+            max_samples = 64;
+        }
+        bool progressive() const
+        {
+            return seconds > 0 || noise > 0;
+        }
+};
+
+// Running sums of the samples of every pixel of a progressive render
+class SampleSums
+{
+    public:
+        int width;
+        std::vector<vec3> sum;
+        std::vector<float> luminance_sq;
+        std::vector<int> count;
+        SampleSums(int width, int height);
+        void add(int row, int col, vec3 color);
+        vec3 mean(int row, int col) const;
+        // Standard error of the mean luminance averaged over the pixels, 
+        // INFINITY while some pixel has fewer than two samples
+        float noise() const;
+};
+
+// Color of a primary ray and the primitive it hit first, a miss has no 
+// store
+class Sample
+{
+    public:
+        vec3 color;
+        const PrimStore *store;
+        unsigned int prim;
+        const Instance *instance;
+};
+
+// True across a silhouette, a change of primitive or a strong change of 
+// color
+bool differ(const Sample &left, const Sample &right);
+
+// Camera and scene every pass of a draw() traces
+class View
+{
+    public:
+        const Accel *t;
+        const std::vector<Light> *lights;
+        vec3 eye;
+        float *mat;
+        float fov;
+        int depth;
+        // Color seen through the image point (y, x), in pixels
+        vec3 trace(float y, float x, int width, int height) const;
+        Sample sample(float y, float x, int width, int height) const;
+};
+
+// COARSE_PASS traces the center of the first pixel of every step x step 
+// block and fills the block with it, skipping the pixels the coarser pass 
+// before it traced already. JITTER_PASS adds a sample at a random spot of 
+// every pixel, index numbers these passes. ADAPTIVE_PASS supersamples the 
+// pixels whose center sample differs from a neighbor's.
+enum pass_type {COARSE_PASS, JITTER_PASS, ADAPTIVE_PASS};
+
+// One pass over the tiles. Tiles still waiting at the deadline are 
+// skipped. With a writer, each band of tiles goes out once it and every 
+// band above it are done.
+class Pass
+{
+    public:
+        pass_type type;
+        int step;
+        int coarser;
+        int index;
+        // Times an adaptive pass may split a pixel into quarters
+        int levels;
+        render_clock::time_point deadline;
+        ImageWriter *writer;
+        // The center samples of every pixel, recorded by a coarse pass and 
+        // compared by an adaptive one
+        std::vector<Sample> *centers;
+        Pass()
+        {
+            type = COARSE_PASS;
+            step = 1;
+            coarser = 0;
+            index = 0;
+            levels = 0;
+            deadline = render_clock::time_point::max();
+            writer = NULL;
+            centers = NULL;
+        }
+};
+
+// Returns the number of primary rays traced
+long long render_pass(const View &view, const Pass &pass, Framebuffer &frame, 
+SampleSums *sums);
+
+// Color of the square of side size at (y, x) with the sample center at its 
+// middle. Traces the middles of its quarters and, where they differ from 
+// center and levels are left, refines each quarter the same way.
+vec3 subdivide(const View &view, float y, float x, float size, 
+const Sample &center, int levels, int width, int height, long long &rays);
+
+void draw(const Accel &t, std::vector<Light> &lights, vec3 eye, vec3 center, 
+vec3 up, float ior, int depth, float bias, float fov, std::string filename, 
+Framebuffer &frame, const RenderBudget &budget, int aa_levels);
 #endif
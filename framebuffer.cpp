@@ -0,0 +1,145 @@
+#include "framebuffer.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+Framebuffer::Framebuffer(int width, int height, pixel_format format)
+{
+    this->width = width;
+    this->height = height;
+    this->format = format;
+    row_bytes = (width * pixel_bytes() + ROW_ALIGN - 1) / ROW_ALIGN * 
+    ROW_ALIGN;
+    void *memory;
+    if (posix_memalign(&memory, ROW_ALIGN, row_bytes * height) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    data = (unsigned char*) memory;
+    memset(data, 0, row_bytes * height);
+}
+
+Framebuffer::~Framebuffer()
+{
+    free(data);
+}
+
+size_t Framebuffer::pixel_bytes() const
+{
+    switch (format)
+    {
+        case HALF:
+            return 3 * sizeof(unsigned short);
+        case BYTE:
+            return 3;
+        default:
+            return 3 * sizeof(float);
+    }
+}
+
+int Framebuffer::span_width(int min_width) const
+{
+    int pixels = ROW_ALIGN;
+    while (pixels % 2 == 0 && pixels / 2 * pixel_bytes() % ROW_ALIGN == 0)
+    {
+        pixels /= 2;
+    }
+    return (min_width + pixels - 1) / pixels * pixels;
+}
+
+void Framebuffer::set(int row, int col, vec3 color)
+{
+    unsigned char *p = pixel(row, col);
+    for (int k = 0; k < 3; k++)
+    {
+        float c = color.coord[k];
+        switch (format)
+        {
+            case HALF:
+                ((unsigned short*) p)[k] = float_to_half(c);
+                break;
+            case BYTE:
+                p[k] = to_byte(c);
+                break;
+            default:
+                ((float*) p)[k] = c;
+        }
+    }
+}
+
+vec3 Framebuffer::get(int row, int col) const
+{
+    const unsigned char *p = pixel(row, col);
+    vec3 result;
+    for (int k = 0; k < 3; k++)
+    {
+        switch (format)
+        {
+            case HALF:
+                result.coord[k] = half_to_float(((unsigned short*) p)[k]);
+                break;
+            case BYTE:
+                result.coord[k] = p[k] / 255.0f;
+                break;
+            default:
+                result.coord[k] = ((float*) p)[k];
+        }
+    }
+    return result;
+}
+
+unsigned short float_to_half(float x)
+{
+    unsigned int bits;
+    memcpy(&bits, &x, sizeof(bits));
+    unsigned int sign = (bits >> 16) & 0x8000;
+    unsigned int mantissa = bits & 0x7fffff;
+    int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+    if (((bits >> 23) & 0xff) == 0xff)
+    {
+        // Infinity stays infinity and NaN stays NaN
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    if (exponent >= 31)
+    {
+        return sign | 0x7c00;
+    }
+    unsigned int shift = 13;
+    if (exponent <= 0)
+    {
+        // Subnormal, the implicit one becomes part of the mantissa
+        if (exponent < -10)
+        {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        exponent = 0;
+    }
+    unsigned int half = (exponent << 10) | (mantissa >> shift);
+    unsigned int rest = mantissa & ((1u << shift) - 1);
+    unsigned int halfway = 1u << (shift - 1);
+    // A carry out of the mantissa correctly bumps the exponent
+    if (rest > halfway || (rest == halfway && (half & 1)))
+    {
+        half++;
+    }
+    return sign | half;
+}
+
+float half_to_float(unsigned short h)
+{
+    unsigned int sign = (h & 0x8000) << 16;
+    unsigned int exponent = (h >> 10) & 0x1f;
+    unsigned int mantissa = h & 0x3ff;
+    if (exponent == 0)
+    {
+        float result = ldexpf(mantissa, -24);
+        return sign ? -result : result;
+    }
+    unsigned int bits = sign | (mantissa << 13);
+    bits |= exponent == 31 ? 0x7f800000 : (exponent - 15 + 127) << 23;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
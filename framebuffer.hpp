@@ -0,0 +1,51 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+#include "vec3.hpp"
+#include <algorithm>
+#include <cstddef>
+// Every row starts on a boundary of this many bytes
+#define ROW_ALIGN 64
+
+// Storage of each color channel, 32 bit float, 16 bit half float or one 
+// byte clamped to [0, 1]
+enum pixel_format {FLOAT32, HALF, BYTE};
+
+// Image sized at runtime. Pixels are three channels of format, rows start 
+// on ROW_ALIGN byte boundaries. Threads write spans of rows side by side, 
+// which only keeps them off each other's cache lines when every span 
+// starts on a boundary too, see span_width().
+class Framebuffer
+{
+    public:
+        int width;
+        int height;
+        pixel_format format;
+        size_t row_bytes;
+        unsigned char *data;
+        Framebuffer(int width, int height, pixel_format format);
+        ~Framebuffer();
+        Framebuffer(const Framebuffer&) = delete;
+        Framebuffer& operator=(const Framebuffer&) = delete;
+        size_t pixel_bytes() const;
+        // Smallest width of at least min_width pixels that fills whole 
+        // ROW_ALIGN blocks, so spans of it laid side by side from the 
+        // start of a row share no block
+        int span_width(int min_width) const;
+        unsigned char* pixel(int row, int col) const
+        {
+            return data + row * row_bytes + col * pixel_bytes();
+        }
+        void set(int row, int col, vec3 color);
+        vec3 get(int row, int col) const;
+};
+
+// Channel clamped to [0, 1] and rounded to 8 bits
+inline unsigned char to_byte(float c)
+{
+    return 255 * std::min(std::max(c, 0.0f), 1.0f) + .5f;
+}
+
+// IEEE half precision, rounded to nearest even
+unsigned short float_to_half(float x);
+float half_to_float(unsigned short h);
+#endif
@@ -1,111 +1,108 @@
 #include <cmath>
 #include <algorithm>
+#include <climits>
 #include "geometry.hpp"
+#include "vec4.hpp"
+
+// In the order of builtin_material
+std::vector<color_info> materials = {
+    // DEFAULT_COLOR
+    {vec3(.5, 0, 0), vec3(.7, .1, .1), vec3(1, 1, 1), OPAQUE, 100, 1}, 
+    // RED
+    {vec3(.5, 0, 0), vec3(.7, .1, .1), vec3(1, 1, 1), OPAQUE, 100, 1}, 
+    // GREEN
+    {vec3(0, .5, 0), vec3(.1, .7, .1), vec3(1, 1, 1), OPAQUE, 100, 1}, 
+    // BLUE
+    {vec3(0, 0, .7), vec3(.1, .1, .7), vec3(1, 1, 1), OPAQUE, 100, 1}, 
+    // PURPLE
+    {vec3(.5, 0, .5), vec3(.7, .1, .7), vec3(1, 1, 1), OPAQUE, 100, 1}, 
+    // BLACK
+    {vec3(), vec3(.1, .1, .1), vec3(1, 1, 1), OPAQUE, 100, 1}, 
+    // MIRROR
+    {vec3(), vec3(), vec3(), REFLECTIVE, 5, 1}, 
+    // GLASS
+    {vec3(), vec3(), vec3(), TRANSPARENT, 5, 1.5}, 
+    // WATER
+    {vec3(), vec3(), vec3(), TRANSPARENT, 5, 1.333}
+};
+
+// Materials are only added while setting up the scene, never during a 
+// render
+material_id add_material(color_info info)
+{
+    materials.push_back(info);
+    return materials.size() - 1;
+}
 
 // https://gamedev.stackexchange.com/questions/18436/
 // most-efficient-aabb-vs-ray-collision-algorithms
 std::pair<float, float> aabb_intersection(vec3 minBounds, vec3 maxBounds, 
 vec3 origin, vec3 dir)
 {
-    float inverse_x = 1.0 / dir.coord[0];
-    float inverse_y = 1.0 / dir.coord[1];
-    float inverse_z = 1.0 / dir.coord[2];
-
-    float t1 = (minBounds.coord[0] - origin.coord[0]) * inverse_x;
-    float t2 = (maxBounds.coord[0] - origin.coord[0]) * inverse_x;
-
-    float t3 = (minBounds.coord[1] - origin.coord[1]) * inverse_y;
-    float t4 = (maxBounds.coord[1] - origin.coord[1]) * inverse_y;
-
-    float t5 = (minBounds.coord[2] - origin.coord[2]) * inverse_z;
-    float t6 = (maxBounds.coord[2] - origin.coord[2]) * inverse_z;
-
-    float t_min = std::max(std::max(std::min(t1, t2), std::min(t3, t4)), 
-    std::min(t5, t6)); 
-    float t_max = std::min(std::min(std::max(t1, t2), std::max(t3, t4)), 
-    std::max(t5, t6));
+    vec4 ray_origin = vec4(origin);
+    vec4 inverse = vec4(dir).reciprocal();
+    float4 t_a = (vec4(minBounds) - ray_origin).comp_mul(inverse).v;
+    float4 t_b = (vec4(maxBounds) - ray_origin).comp_mul(inverse).v;
+    float t_min = hmax3(min4(t_b, t_a));
+    float t_max = hmin3(max4(t_b, t_a));
     std::pair<float, float> result;
     if (t_min > t_max)
     {
         result.first = INFINITY;
         result.second = INFINITY;
     }
-    result.first = t_min;
-    result.second = t_max;
+    else
+    {
+        result.first = t_min;
+        result.second = t_max;
+    }
     return result;
 }
 
+float surface_area(vec3 minBounds, vec3 maxBounds)
+{
+    vec3 d = maxBounds - minBounds;
+    return 2 * (d.coord[0] * d.coord[1] + d.coord[1] * d.coord[2] + 
+    d.coord[2] * d.coord[0]);
+}
 
-float Sphere::intersection(vec3 origin, vec3 direction) const
+int longest_axis(vec3 minBounds, vec3 maxBounds)
 {
-    float ans;
-    float discriminant = pow(direction * (origin - this->pos), 2.0) - 
-    (pow((origin - this->pos).norm(), 2.0)- pow(radius, 2.0));
-    if (discriminant < 0)
-    {
-        ans = INFINITY;
-    }
-    else if (discriminant == 0)
-    {
-        float neg_term = -(direction * (origin - this->pos));
-        ans = neg_term;
-    }
-    else
+    vec3 d = maxBounds - minBounds;
+    int axis = 0;
+    for (int i = 1; i < 3; i++)
     {
-        float neg_term = -(direction * (origin - this->pos));
-        // Discard negative solutions, return smallest positive answer
-        float pos_answer = neg_term + pow(discriminant, .5);
-        float neg_answer = neg_term - pow(discriminant, .5);
-        if (neg_answer > 0)
-        {  
-            ans = neg_answer;
-        }
-        else
+        if (d.coord[i] > d.coord[axis])
         {
-            ans = pos_answer > 0 ? pos_answer : INFINITY;
+            axis = i;
         }
     }
-    return ans;
+    return axis;
 }
 
-// https://blackpawn.com/texts/pointinpoly/
-float Triangle::intersection(vec3 origin, vec3 direction) const
+Ray::Ray(vec3 origin, vec3 direction)
 {
-    // Point on plane containing triangle that ray intersects with
-    float dist = ((this->v0 - origin) * this->n) / (this->n * direction);
-    if (dist < 0)
+    this->origin = origin;
+    this->direction = direction;
+    kz = 0;
+    for (int i = 1; i < 3; i++)
     {
-        return INFINITY;
-    }
-    vec3 point = origin + dist * direction;
-
-    // Determining if point is in triangle
-    vec3 p0 = v2 - v0;
-    vec3 p1 = v1 - v0;
-    vec3 p2 = point - v0;
-
-    float dot00 = p0 * p0;
-    float dot01 = p0 * p1;
-    float dot02 = p0 * p2;
-    float dot11 = p1 * p1;
-    float dot12 = p1 * p2;
-
-    float denom = 1.0 / (dot00 * dot11 - dot01 * dot01);
-    float u = (dot11 * dot02 - dot01 * dot12) * denom;
-    float v = (dot00 * dot12 - dot01 * dot02) * denom;
-    
-    
-    if ((u >= 0) && (v >= 0) && (u + v < 1))
-    {
-        return dist;
+        if (std::abs(direction.coord[i]) > std::abs(direction.coord[kz]))
+        {
+            kz = i;
+        }
     }
-    else
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if (direction.coord[kz] < 0)
     {
-        return INFINITY;
+        std::swap(kx, ky);
     }
+    sz = 1.0 / direction.coord[kz];
+    sx = direction.coord[kx] * sz;
+    sy = direction.coord[ky] * sz;
 }
 
-
 std::pair<vec3, vec3> Sphere::sphere_bounds() const
 {
     std::pair<vec3, vec3> result;
@@ -115,6 +112,11 @@ std::pair<vec3, vec3> Sphere::sphere_bounds() const
 }
 
 std::pair<vec3, vec3> Triangle::triangle_bounds() const
+{
+    return vertex_bounds(v0, v1, v2);
+}
+
+std::pair<vec3, vec3> vertex_bounds(vec3 v0, vec3 v1, vec3 v2)
 {
     vec3 total_min = vec3(INFINITY, INFINITY, INFINITY);
     vec3 total_max = -total_min;
@@ -149,6 +151,11 @@ std::pair<vec3, vec3> Triangle::triangle_bounds() const
 }
 
 bool Sphere::inBounds(vec3 min, vec3 max) const
+{
+    return sphere_box_overlap(pos, radius, min, max);
+}
+
+bool sphere_box_overlap(vec3 pos, float radius, vec3 min, vec3 max)
 {
     float dmin = 0;
     for (int i = 0; i < 3; i++)
@@ -165,9 +172,15 @@ bool Sphere::inBounds(vec3 min, vec3 max) const
     return (dmin <= radius * radius);
 }
 
+bool Triangle::inBounds(vec3 min, vec3 max) const
+{
+    return triangle_box_overlap(v0, v1, v2, n, min, max);
+}
+
 // https://fileadmin.cs.lth.se/cs/Personal/Tomas_Akenine-Moller/
 // code/tribox_tam.pdf
-bool Triangle::inBounds(vec3 min, vec3 max) const
+bool triangle_box_overlap(vec3 v0, vec3 v1, vec3 v2, vec3 n, vec3 min, 
+vec3 max)
 {
     vec3 box_center = .5 * (min + max);
     vec3 half_length = vec3(max.coord[0] - box_center.coord[0], 
@@ -226,6 +239,79 @@ std::pair<vec3, vec3> Triangle::bounds() const
     return result;
 }
 
+std::pair<vec3, vec3> TriMesh::bounds(unsigned int tri) const
+{
+    return vertex_bounds(vertex(tri, 0), vertex(tri, 1), vertex(tri, 2));
+}
+
+bool TriMesh::inBounds(unsigned int tri, vec3 min, vec3 max) const
+{
+    return triangle_box_overlap(vertex(tri, 0), vertex(tri, 1), 
+    vertex(tri, 2), normal(tri), min, max);
+}
+
+void TriMesh::compress()
+{
+    unsigned int num_vertices = vertices.size();
+    unsigned int num_clusters = (num_vertices + MESH_CLUSTER_SIZE - 1) / 
+    MESH_CLUSTER_SIZE;
+    quantized.resize(3 * num_vertices);
+    lattice_origin.resize(num_clusters);
+    lattice_step.resize(num_clusters);
+    for (unsigned int c = 0; c < num_clusters; c++)
+    {
+        unsigned int first = c * MESH_CLUSTER_SIZE;
+        unsigned int last = std::min(first + MESH_CLUSTER_SIZE, num_vertices);
+        vec3 min = vertices[first];
+        vec3 max = vertices[first];
+        for (unsigned int v = first + 1; v < last; v++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                min.coord[k] = std::min(min.coord[k], vertices[v].coord[k]);
+                max.coord[k] = std::max(max.coord[k], vertices[v].coord[k]);
+            }
+        }
+        vec3 step;
+        for (int k = 0; k < 3; k++)
+        {
+            step.coord[k] = (max.coord[k] - min.coord[k]) / USHRT_MAX;
+        }
+        lattice_origin[c] = min;
+        lattice_step[c] = step;
+        for (unsigned int v = first; v < last; v++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                float q = step.coord[k] > 0 ? 
+                (vertices[v].coord[k] - min.coord[k]) / step.coord[k] : 0;
+                quantized[3 * v + k] = std::min(lround(q), (long) USHRT_MAX);
+            }
+        }
+    }
+    std::vector<vec3>().swap(vertices);
+}
+
+void SphereField::add(vec3 center, float radius)
+{
+    x.push_back(center.coord[0]);
+    y.push_back(center.coord[1]);
+    z.push_back(center.coord[2]);
+    this->radius.push_back(radius);
+}
+
+std::pair<vec3, vec3> SphereField::bounds(unsigned int i) const
+{
+    float r = radius[i];
+    return std::make_pair(center(i) + vec3(-r, -r, -r), 
+    center(i) + vec3(r, r, r));
+}
+
+bool SphereField::inBounds(unsigned int i, vec3 min, vec3 max) const
+{
+    return sphere_box_overlap(center(i), radius[i], min, max);
+}
+
 std::pair<vec3, vec3> Sphere::bounds() const
 {
     std::pair<vec3, vec3> result;
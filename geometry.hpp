@@ -2,10 +2,18 @@
 #define GEOMETRY_H
 #include "vec3.hpp"
 #include <vector>
+#include <cmath>
 #define BOX_BIAS .01
+// Vertices of a compressed mesh share a lattice in runs of this many
+#define MESH_CLUSTER_SHIFT 10
+#define MESH_CLUSTER_SIZE (1u << MESH_CLUSTER_SHIFT)
 
 enum vis_type {TRANSPARENT, OPAQUE, REFLECTIVE};
 
+// MESH_TRIANGLE and FIELD_SPHERE only tag references into a TriMesh or a 
+// SphereField, no Shape has them
+enum shape_type {SPHERE, TRIANGLE, MESH_TRIANGLE, FIELD_SPHERE};
+
 class color_info
 {
     public:
@@ -17,57 +25,57 @@ class color_info
         float ior;
 };
 
-const color_info DEFAULT_COLOR{vec3(.5, 0, 0), vec3(.7, .1, .1), 
-vec3(1, 1, 1), OPAQUE, 100, 1};
-
-const color_info RED{vec3(.5, 0, 0), vec3(.7, .1, .1), 
-vec3(1, 1, 1), OPAQUE, 100, 1};
-
-const color_info GREEN{vec3(0, .5, 0), vec3(.1, .7, .1), 
-vec3(1, 1, 1), OPAQUE, 100, 1};
-
-const color_info BLUE{vec3(0, 0, .7), vec3(.1, .1, .7), 
-vec3(1, 1, 1), OPAQUE, 100, 1};
+// Index into the material table
+typedef unsigned short material_id;
 
-const color_info PURPLE{vec3(.5, 0, .5), vec3(.7, .1, .7), 
-vec3(1, 1, 1), OPAQUE, 100, 1};
+// Materials every table starts with, in table order
+enum builtin_material {DEFAULT_COLOR, RED, GREEN, BLUE, PURPLE, BLACK, MIRROR, 
+GLASS, WATER};
 
-const color_info BLACK{vec3(), vec3(.1, .1, .1), 
-vec3(1, 1, 1), OPAQUE, 100, 1};
+// Materials of the scene. Primitives only keep an index into this, shading 
+// looks the material up once the closest hit is known. Starts out with the 
+// builtin materials, add_material() appends more.
+extern std::vector<color_info> materials;
 
-const color_info MIRROR{vec3(), vec3(), vec3(), REFLECTIVE, 5, 1};
+material_id add_material(color_info info);
 
-const color_info GLASS{vec3(), vec3(), vec3(), TRANSPARENT, 5, 1.5};
-
-const color_info WATER{vec3(), vec3(), vec3(), TRANSPARENT, 5, 1.333};
+// Ray with the shear used by the watertight triangle test precomputed, 
+// so each triangle only needs its vertices. kz is the dominant axis of the 
+// direction, kx and ky are swapped to keep the winding when it's negative.
+class Ray
+{
+    public:
+        vec3 origin;
+        vec3 direction;
+        int kx;
+        int ky;
+        int kz;
+        float sx;
+        float sy;
+        float sz;
+        Ray(vec3 origin, vec3 direction);
+};
 
 class Shape 
 {
     public:
-        vec3 ka;
-        vec3 kd;
-        vec3 ks;
-        vis_type vis; 
-        float alpha;
-        float ior;
         vec3 minBounds;
         vec3 maxBounds;
+        // Set by each subclass so containers can dispatch on it directly
+        shape_type type;
+        material_id material;
         // Random values for an opaque object 
         Shape()
         {
-           ka = DEFAULT_COLOR.ka;
-           kd = DEFAULT_COLOR.kd;
-           ks = DEFAULT_COLOR.ks;
-           vis = DEFAULT_COLOR.vis;
-           alpha = DEFAULT_COLOR.alpha;
-           ior = DEFAULT_COLOR.ior;
+           material = DEFAULT_COLOR;
            minBounds = vec3();
            maxBounds = vec3();
         }
         virtual bool inBounds(vec3 min, vec3 max) const = 0;
         virtual std::pair<vec3, vec3> bounds() const = 0;
         virtual vec3 normal(vec3 point) const = 0;
-        virtual float intersection(vec3 origin, vec3 direction) const = 0;
+        // Distance along the ray to the nearest hit, INFINITY on a miss
+        virtual float intersection(const Ray &ray) const = 0;
 };
 
 class Sphere: public Shape
@@ -78,12 +86,14 @@ class Sphere: public Shape
         std::pair<vec3, vec3> sphere_bounds() const;
         Sphere()
         {
+            type = SPHERE;
             pos = vec3(0, 0, 0);
             radius = 0;
         }
 
         Sphere(vec3 pos, float radius)
         {
+            type = SPHERE;
             this->pos = pos;
             this->radius = radius;
             std::pair<vec3, vec3> bound = this->sphere_bounds();
@@ -93,9 +103,9 @@ class Sphere: public Shape
 
         vec3 normal(vec3 point) const
         {
-            return (point - this->pos).normalize();
+            return (1 / radius) * (point - this->pos);
         }
-        float intersection(vec3 origin, vec3 direction) const;
+        float intersection(const Ray &ray) const;
         bool inBounds(vec3 min, vec3 max) const;
         std::pair<vec3, vec3> bounds() const;
 
@@ -111,6 +121,7 @@ class Triangle: public Shape
         std::pair<vec3, vec3> triangle_bounds() const;
         Triangle()
         {
+            type = TRIANGLE;
             v0 = vec3(0, 0, 0);
             v1 = vec3(0, 0, 0);
             v2 = vec3(0, 0, 0);
@@ -119,6 +130,7 @@ class Triangle: public Shape
         // Initialize vertices counterclockwise to get rhr normal
         Triangle(vec3 v0, vec3 v1, vec3 v2)
         {
+            type = TRIANGLE;
             this->v0 = v0;
             this->v1 = v1;
             this->v2 = v2;
@@ -130,6 +142,7 @@ class Triangle: public Shape
 
         Triangle(vec3 v0, vec3 v1, vec3 v2, vec3 normal)
         {
+            type = TRIANGLE;
             this->v0 = v0;
             this->v1 = v1;
             this->v2 = v2;
@@ -143,11 +156,132 @@ class Triangle: public Shape
         {
             return this->n;
         }
-        float intersection(vec3 origin, vec3 direction) const;
+        float intersection(const Ray &ray) const;
+        // Also gives the barycentric weights u of v1 and v v of v2
+        float intersection(const Ray &ray, float &u, float &v) const;
         bool inBounds(vec3 min, vec3 max) const;
         std::pair<vec3, vec3> bounds() const;
 };
 
+// Corners of a triangle without the rest of the Shape, for arrays that 
+// the intersection kernels walk
+class TriangleVerts
+{
+    public:
+        vec3 v0;
+        vec3 v1;
+        vec3 v2;
+};
+
+// Triangles sharing one vertex buffer, each one three indices into it. 
+// There is no Shape per triangle, shading takes the mesh's material and 
+// the normal of the indexed corners.
+class TriMesh
+{
+    public:
+        std::vector<vec3> vertices;
+        std::vector<unsigned int> indices;
+        // Corner normals from the file, three indices into normals per 
+        // triangle. Both are empty for a flat shaded mesh.
+        std::vector<vec3> normals;
+        std::vector<unsigned int> normal_indices;
+        material_id material;
+        // Positions after compress(), three 16 bit steps per vertex along 
+        // the lattice of its cluster. Every triangle decodes a shared 
+        // vertex to the same point, so the mesh stays watertight, and trees 
+        // are built over the decoded triangles, so no hit is lost.
+        std::vector<unsigned short> quantized;
+        std::vector<vec3> lattice_origin;
+        std::vector<vec3> lattice_step;
+        unsigned int size() const
+        {
+            return indices.size() / 3;
+        }
+        bool compressed() const
+        {
+            return !quantized.empty();
+        }
+        unsigned int num_vertices() const
+        {
+            return compressed() ? quantized.size() / 3 : vertices.size();
+        }
+        vec3 position(unsigned int v) const
+        {
+            if (!compressed())
+            {
+                return vertices[v];
+            }
+            const vec3 &origin = lattice_origin[v >> MESH_CLUSTER_SHIFT];
+            const vec3 &step = lattice_step[v >> MESH_CLUSTER_SHIFT];
+            const unsigned short *q = &quantized[3 * v];
+            return vec3(origin.coord[0] + q[0] * step.coord[0], 
+            origin.coord[1] + q[1] * step.coord[1], 
+            origin.coord[2] + q[2] * step.coord[2]);
+        }
+        vec3 vertex(unsigned int tri, int corner) const
+        {
+            return position(indices[3 * tri + corner]);
+        }
+        // Replaces the float vertices with quantized ones
+        void compress();
+        // Same winding as a Triangle built from the three corners
+        vec3 normal(unsigned int tri) const
+        {
+            vec3 v0 = vertex(tri, 0);
+            return ((vertex(tri, 1) - v0).crossProduct(vertex(tri, 2) - v0))
+            .normalize();
+        }
+        // Corner normals weighted by the barycentrics of a hit, or the 
+        // face normal without them
+        vec3 shading_normal(unsigned int tri, float u, float v) const
+        {
+            if (normal_indices.empty())
+            {
+                return normal(tri);
+            }
+            const unsigned int *n = &normal_indices[3 * tri];
+            return ((1 - u - v) * normals[n[0]] + u * normals[n[1]] + 
+            v * normals[n[2]]).normalize();
+        }
+        std::pair<vec3, vec3> bounds(unsigned int tri) const;
+        bool inBounds(unsigned int tri, vec3 min, vec3 max) const;
+        // Memory held by the buffers
+        size_t bytes() const
+        {
+            return (vertices.size() + normals.size() + lattice_origin.size() + 
+            lattice_step.size()) * sizeof(vec3) + (indices.size() + 
+            normal_indices.size()) * sizeof(unsigned int) + 
+            quantized.size() * sizeof(unsigned short);
+        }
+};
+
+// Spheres sharing one material, stored as separate arrays of center 
+// coordinates and radii so SIMD kernels load them straight into lanes
+class SphereField
+{
+    public:
+        std::vector<float> x;
+        std::vector<float> y;
+        std::vector<float> z;
+        std::vector<float> radius;
+        material_id material;
+        SphereField()
+        {
+            material = DEFAULT_COLOR;
+        }
+        unsigned int size() const
+        {
+            return radius.size();
+        }
+        vec3 center(unsigned int i) const
+        {
+            return vec3(x[i], y[i], z[i]);
+        }
+        void add(vec3 center, float radius);
+        std::pair<vec3, vec3> bounds(unsigned int i) const;
+        bool inBounds(unsigned int i, vec3 min, vec3 max) const;
+};
+
 class Light
 {
     public:
@@ -173,4 +307,106 @@ class Light
 };
 std::pair<float, float> aabb_intersection(vec3 minBounds, vec3 maxBounds, 
 vec3 origin, vec3 dir);
+float surface_area(vec3 minBounds, vec3 maxBounds);
+int longest_axis(vec3 minBounds, vec3 maxBounds);
+std::pair<vec3, vec3> vertex_bounds(vec3 v0, vec3 v1, vec3 v2);
+bool triangle_box_overlap(vec3 v0, vec3 v1, vec3 v2, vec3 n, vec3 min, 
+vec3 max);
+bool sphere_box_overlap(vec3 pos, float radius, vec3 min, vec3 max);
+
+// The intersection kernels live here so callers that know the type can 
+// inline them
+
+// Expects a unit direction, so the quadratic's leading coefficient is one. 
+// SpherePack repeats these operations in the same order.
+inline float sphere_intersection(vec3 pos, float radius, const Ray &ray)
+{
+    vec3 oc = ray.origin - pos;
+    float b = ray.direction * oc;
+    float c = oc * oc - radius * radius;
+    float discriminant = b * b - c;
+    if (discriminant < 0)
+    {
+        return INFINITY;
+    }
+    float root = std::sqrt(discriminant);
+    // Discard negative solutions, return smallest positive answer
+    float near = -b - root;
+    if (near > 0)
+    {
+        return near;
+    }
+    float far = -b + root;
+    return far > 0 ? far : INFINITY;
+}
+
+inline float Sphere::intersection(const Ray &ray) const
+{
+    return sphere_intersection(pos, radius, ray);
+}
+
+inline float Triangle::intersection(const Ray &ray) const
+{
+    float u;
+    float v;
+    return intersection(ray, u, v);
+}
+
+// Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection". The 
+// vertices are moved into a space where the ray runs along +z from the 
+// origin, so the hit test is three 2D edge functions. Neighbouring 
+// triangles evaluate a shared edge with the same numbers, which leaves no 
+// cracks between them, and exact zeros are redone in double precision.
+inline float triangle_intersection(const vec3 &v0, const vec3 &v1, 
+const vec3 &v2, const Ray &ray, float &u, float &v)
+{
+    int kx = ray.kx;
+    int ky = ray.ky;
+    int kz = ray.kz;
+    float a_z = v0.coord[kz] - ray.origin.coord[kz];
+    float b_z = v1.coord[kz] - ray.origin.coord[kz];
+    float c_z = v2.coord[kz] - ray.origin.coord[kz];
+    float a_x = v0.coord[kx] - ray.origin.coord[kx] - ray.sx * a_z;
+    float a_y = v0.coord[ky] - ray.origin.coord[ky] - ray.sy * a_z;
+    float b_x = v1.coord[kx] - ray.origin.coord[kx] - ray.sx * b_z;
+    float b_y = v1.coord[ky] - ray.origin.coord[ky] - ray.sy * b_z;
+    float c_x = v2.coord[kx] - ray.origin.coord[kx] - ray.sx * c_z;
+    float c_y = v2.coord[ky] - ray.origin.coord[ky] - ray.sy * c_z;
+
+    // Edge functions, each one is the weight of the opposite vertex
+    float e_a = c_x * b_y - c_y * b_x;
+    float e_b = a_x * c_y - a_y * c_x;
+    float e_c = b_x * a_y - b_y * a_x;
+    if (e_a == 0 || e_b == 0 || e_c == 0)
+    {
+        e_a = double(c_x) * b_y - double(c_y) * b_x;
+        e_b = double(a_x) * c_y - double(a_y) * c_x;
+        e_c = double(b_x) * a_y - double(b_y) * a_x;
+    }
+    if ((e_a < 0 || e_b < 0 || e_c < 0) && (e_a > 0 || e_b > 0 || e_c > 0))
+    {
+        return INFINITY;
+    }
+    float det = e_a + e_b + e_c;
+    if (det == 0)
+    {
+        return INFINITY;
+    }
+
+    // Scaled distance, its sign has to match det for a hit in front
+    float t_scaled = ray.sz * (e_a * a_z + e_b * b_z + e_c * c_z);
+    if (det > 0 ? t_scaled < 0 : t_scaled > 0)
+    {
+        return INFINITY;
+    }
+    float inv_det = 1.0f / det;
+    u = e_b * inv_det;
+    v = e_c * inv_det;
+    return t_scaled * inv_det;
+}
+
+inline float Triangle::intersection(const Ray &ray, float &u, float &v) const
+{
+    return triangle_intersection(v0, v1, v2, ray, u, v);
+}
 #endif
@@ -0,0 +1,271 @@
+#include "image_writer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+bool ImageWriter::finish()
+{
+    file.close();
+    return !file.fail();
+}
+
+PpmWriter::PpmWriter(const std::string &path, int width, int height)
+{
+    this->width = width;
+    this->height = height;
+    row.resize(3 * width);
+    file.open(path, std::ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+}
+
+void PpmWriter::write_rows(const Framebuffer &frame, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        for (int j = 0; j < width; j++)
+        {
+            vec3 color = frame.get(i, j);
+            for (int k = 0; k < 3; k++)
+            {
+                row[3 * j + k] = to_byte(color.coord[k]);
+            }
+        }
+        file.write((const char*) row.data(), row.size());
+    }
+}
+
+PfmWriter::PfmWriter(const std::string &path, int width, int height)
+{
+    this->width = width;
+    this->height = height;
+    row.resize(3 * width);
+    file.open(path, std::ios::binary);
+    // A negative scale marks little endian data
+    unsigned int one = 1;
+    bool little_endian = *(unsigned char*) &one == 1;
+    file << "PF\n" << width << " " << height << "\n" << 
+    (little_endian ? "-1.0" : "1.0") << "\n";
+    data_start = file.tellp();
+}
+
+void PfmWriter::write_rows(const Framebuffer &frame, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        for (int j = 0; j < width; j++)
+        {
+            vec3 color = frame.get(i, j);
+            for (int k = 0; k < 3; k++)
+            {
+                row[3 * j + k] = color.coord[k];
+            }
+        }
+        std::streamoff row_size = row.size() * sizeof(float);
+        file.seekp(data_start + (height - 1 - i) * row_size);
+        file.write((const char*) row.data(), row_size);
+    }
+}
+
+HdrWriter::HdrWriter(const std::string &path, int width, int height)
+{
+    this->width = width;
+    this->height = height;
+    row.resize(4 * width);
+    file.open(path, std::ios::binary);
+    file << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " << height << " +X " << 
+    width << "\n";
+}
+
+// Scanlines in the width range of the run length format are written in it 
+// as plain dumps of each component. A flat scanline starting with the bytes 
+// 2 2 would be mistaken for one.
+void HdrWriter::write_rows(const Framebuffer &frame, int first, int count)
+{
+    bool encoded = width >= 8 && width < 32768;
+    for (int i = first; i < first + count; i++)
+    {
+        for (int j = 0; j < width; j++)
+        {
+            vec3 color = frame.get(i, j);
+            unsigned char *rgbe = &row[4 * j];
+            float brightest = std::max(color.coord[0], 
+            std::max(color.coord[1], color.coord[2]));
+            if (!(brightest > 1e-32))
+            {
+                rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+                continue;
+            }
+            int exponent;
+            float scale = frexpf(brightest, &exponent) * 256 / brightest;
+            for (int k = 0; k < 3; k++)
+            {
+                rgbe[k] = std::max(color.coord[k], 0.0f) * scale;
+            }
+            rgbe[3] = exponent + 128;
+        }
+        if (!encoded)
+        {
+            file.write((const char*) row.data(), row.size());
+            continue;
+        }
+        unsigned char start[4] = {2, 2, (unsigned char) (width >> 8), 
+        (unsigned char) (width & 0xff)};
+        file.write((const char*) start, 4);
+        for (int k = 0; k < 4; k++)
+        {
+            for (int j = 0; j < width; j += 128)
+            {
+                int dump = std::min(width - j, 128);
+                file.put(dump);
+                for (int p = j; p < j + dump; p++)
+                {
+                    file.put(row[4 * p + k]);
+                }
+            }
+        }
+    }
+}
+
+PngWriter::PngWriter(const std::string &path, int width, int height)
+{
+    this->width = width;
+    this->height = height;
+    row.resize(3 * width);
+    previous.assign(3 * width, 0);
+    filtered.resize(3 * width + 1);
+    chunk.resize(PNG_CHUNK_SIZE);
+    stream = z_stream();
+    deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+    stream.next_out = chunk.data();
+    stream.avail_out = chunk.size();
+    file.open(path, std::ios::binary);
+    const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, 
+    '\n'};
+    file.write((const char*) signature, 8);
+    // Size, 8 bits per channel, RGB, no interlacing
+    unsigned char header[13] = {0, 0, 0, 0, 0, 0, 0, 0, 8, 2, 0, 0, 0};
+    for (int b = 0; b < 4; b++)
+    {
+        header[b] = width >> (24 - 8 * b);
+        header[4 + b] = height >> (24 - 8 * b);
+    }
+    write_chunk("IHDR", header, 13);
+}
+
+PngWriter::~PngWriter()
+{
+    deflateEnd(&stream);
+}
+
+void PngWriter::write_rows(const Framebuffer &frame, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        for (int j = 0; j < width; j++)
+        {
+            vec3 color = frame.get(i, j);
+            for (int k = 0; k < 3; k++)
+            {
+                row[3 * j + k] = to_byte(color.coord[k]);
+            }
+        }
+        // Paeth filter, each byte predicted from the ones left, above and 
+        // above left of it
+        filtered[0] = 4;
+        for (unsigned int b = 0; b < row.size(); b++)
+        {
+            int left = b >= 3 ? row[b - 3] : 0;
+            int up = previous[b];
+            int up_left = b >= 3 ? previous[b - 3] : 0;
+            int estimate = left + up - up_left;
+            int d_left = abs(estimate - left);
+            int d_up = abs(estimate - up);
+            int d_up_left = abs(estimate - up_left);
+            int predicted = d_left <= d_up && d_left <= d_up_left ? left : 
+            d_up <= d_up_left ? up : up_left;
+            filtered[b + 1] = row[b] - predicted;
+        }
+        row.swap(previous);
+        stream.next_in = filtered.data();
+        stream.avail_in = filtered.size();
+        deflate_into_chunks(Z_NO_FLUSH);
+    }
+}
+
+bool PngWriter::finish()
+{
+    deflate_into_chunks(Z_FINISH);
+    write_chunk("IDAT", chunk.data(), chunk.size() - stream.avail_out);
+    write_chunk("IEND", NULL, 0);
+    return ImageWriter::finish();
+}
+
+// Runs deflate until the input is used up, or the stream is complete for 
+// Z_FINISH, writing out every chunk that fills
+void PngWriter::deflate_into_chunks(int flush)
+{
+    while (true)
+    {
+        int status = deflate(&stream, flush);
+        if (stream.avail_out == 0)
+        {
+            write_chunk("IDAT", chunk.data(), chunk.size());
+            stream.next_out = chunk.data();
+            stream.avail_out = chunk.size();
+        }
+        else if (flush != Z_FINISH || status == Z_STREAM_END)
+        {
+            return;
+        }
+    }
+}
+
+void PngWriter::write_chunk(const char *type, const unsigned char *data, 
+unsigned int size)
+{
+    unsigned char length[4];
+    unsigned char crc_bytes[4];
+    unsigned long crc = crc32(0, (const unsigned char*) type, 4);
+    if (size > 0)
+    {
+        // crc32() restarts on a NULL buffer
+        crc = crc32(crc, data, size);
+    }
+    for (int b = 0; b < 4; b++)
+    {
+        length[b] = size >> (24 - 8 * b);
+        crc_bytes[b] = crc >> (24 - 8 * b);
+    }
+    file.write((const char*) length, 4);
+    file.write(type, 4);
+    file.write((const char*) data, size);
+    file.write((const char*) crc_bytes, 4);
+}
+
+std::shared_ptr<ImageWriter> open_image(const std::string &path, int width, 
+int height)
+{
+    std::string extension = path.substr(path.find_last_of('.') + 1);
+    std::shared_ptr<ImageWriter> result;
+    if (extension == "ppm")
+    {
+        result = std::make_shared<PpmWriter>(path, width, height);
+    }
+    else if (extension == "pfm")
+    {
+        result = std::make_shared<PfmWriter>(path, width, height);
+    }
+    else if (extension == "hdr")
+    {
+        result = std::make_shared<HdrWriter>(path, width, height);
+    }
+    else if (extension == "png")
+    {
+        result = std::make_shared<PngWriter>(path, width, height);
+    }
+    if (result && !result->file)
+    {
+        result = NULL;
+    }
+    return result;
+}
@@ -0,0 +1,80 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+#include "framebuffer.hpp"
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <zlib.h>
+// Compressed bytes gathered before they go out as one PNG IDAT chunk
+#define PNG_CHUNK_SIZE (1 << 16)
+
+// Writes an image file a band of rows at a time, so rows can go to disk as 
+// soon as they are rendered and no copy of the whole image is made. Rows 
+// have to arrive in order from the top.
+class ImageWriter
+{
+    public:
+        int width;
+        int height;
+        std::ofstream file;
+        virtual ~ImageWriter() {}
+        virtual void write_rows(const Framebuffer &frame, int first, 
+        int count) = 0;
+        // Completes the file, false if anything failed to write
+        virtual bool finish();
+};
+
+// Binary 8 bit RGB
+class PpmWriter: public ImageWriter
+{
+    public:
+        std::vector<unsigned char> row;
+        PpmWriter(const std::string &path, int width, int height);
+        void write_rows(const Framebuffer &frame, int first, int count);
+};
+
+// 32 bit float RGB, unclamped. The format stores rows bottom up, so each 
+// row is written straight to its place in the file.
+class PfmWriter: public ImageWriter
+{
+    public:
+        std::streampos data_start;
+        std::vector<float> row;
+        PfmWriter(const std::string &path, int width, int height);
+        void write_rows(const Framebuffer &frame, int first, int count);
+};
+
+// Radiance RGBE, shared exponent floats in flat scanlines
+class HdrWriter: public ImageWriter
+{
+    public:
+        std::vector<unsigned char> row;
+        HdrWriter(const std::string &path, int width, int height);
+        void write_rows(const Framebuffer &frame, int first, int count);
+};
+
+// 8 bit RGB PNG. Rows are Paeth filtered and fed through one deflate 
+// stream, which is emitted as IDAT chunks as the output fills up.
+class PngWriter: public ImageWriter
+{
+    public:
+        z_stream stream;
+        std::vector<unsigned char> row;
+        std::vector<unsigned char> previous;
+        std::vector<unsigned char> filtered;
+        std::vector<unsigned char> chunk;
+        PngWriter(const std::string &path, int width, int height);
+        ~PngWriter();
+        void write_rows(const Framebuffer &frame, int first, int count);
+        bool finish();
+        void deflate_into_chunks(int flush);
+        void write_chunk(const char *type, const unsigned char *data, 
+        unsigned int size);
+};
+
+// Picks the writer from the extension, .ppm, .pfm, .hdr or .png. NULL for 
+// anything else or if the file can't be created.
+std::shared_ptr<ImageWriter> open_image(const std::string &path, int width, 
+int height);
+#endif
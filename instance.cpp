@@ -0,0 +1,379 @@
+#include "instance.hpp"
+#include "bvh4.hpp"
+#include "loader.hpp"
+#include <algorithm>
+
+Transform Transform::inverse() const
+{
+    Transform result;
+    float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - 
+    m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) + 
+    m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    float inv_det = 1.0 / det;
+    // Adjugate from cofactors taken cyclically, which folds in their signs
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            result.m[i][j] = inv_det * 
+            (m[(j + 1) % 3][(i + 1) % 3] * m[(j + 2) % 3][(i + 2) % 3] - 
+            m[(j + 1) % 3][(i + 2) % 3] * m[(j + 2) % 3][(i + 1) % 3]);
+        }
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        result.m[i][3] = -(result.m[i][0] * m[0][3] + 
+        result.m[i][1] * m[1][3] + result.m[i][2] * m[2][3]);
+    }
+    return result;
+}
+
+Transform translate_scale(vec3 pos, vec3 scaler)
+{
+    Transform result;
+    for (int i = 0; i < 3; i++)
+    {
+        result.m[i][i] = scaler.coord[i];
+        result.m[i][3] = pos.coord[i];
+    }
+    return result;
+}
+
+Mesh::Mesh(std::string path, material_id info, std::string accel_type, 
+int leaf_size, bool compress)
+{
+    geometry = std::make_shared<TriMesh>(load_trimesh(path, info));
+    place(*geometry, *geometry, vec3(), vec3(1, 1, 1));
+    if (compress)
+    {
+        geometry->compress();
+    }
+    tree = make_accel(accel_type, PrimStore(std::vector<Shape*>(), geometry), 
+    leaf_size);
+    minBounds = tree->minBounds;
+    maxBounds = tree->maxBounds;
+}
+
+// Moving a mesh's triangles only needs its own tree brought up to date, 
+// the instances using it are refitted by their tlas
+void Mesh::update()
+{
+    tree->update();
+    minBounds = tree->minBounds;
+    maxBounds = tree->maxBounds;
+}
+
+Hit Mesh::intersect(vec3 origin, vec3 direction, float t_max) const
+{
+    return tree->intersect(origin, direction, t_max);
+}
+
+bool Mesh::occluded(vec3 origin, vec3 direction, float max_dist) const
+{
+    return tree->occluded(origin, direction, max_dist);
+}
+
+Instance::Instance(std::shared_ptr<Accel> object, Transform to_world)
+{
+    this->object = object;
+    set_transform(to_world);
+}
+
+// Also refreshes the world bounds, which pick up changes to the object's
+void Instance::set_transform(Transform to_world)
+{
+    this->to_world = to_world;
+    this->to_object = to_world.inverse();
+    minBounds = vec3(INFINITY, INFINITY, INFINITY);
+    maxBounds = -minBounds;
+    for (int i = 0; i < 8; i++)
+    {
+        vec3 corner = vec3(
+        (i & 1 ? object->maxBounds : object->minBounds).coord[0], 
+        (i & 2 ? object->maxBounds : object->minBounds).coord[1], 
+        (i & 4 ? object->maxBounds : object->minBounds).coord[2]);
+        corner = to_world.point(corner);
+        grow(minBounds, maxBounds, corner, corner);
+    }
+}
+
+Hit Instance::intersect(vec3 origin, vec3 direction, float t_max) const
+{
+    vec3 obj_dir = to_object.vector(direction);
+    float len = obj_dir.norm();
+    Hit result = object->intersect(to_object.point(origin), 
+    (1.0 / len) * obj_dir, t_max * len);
+    result.t /= len;
+    if (result.t < INFINITY)
+    {
+        result.instance = this;
+    }
+    return result;
+}
+
+bool Instance::occluded(vec3 origin, vec3 direction, float max_dist) const
+{
+    vec3 obj_dir = to_object.vector(direction);
+    float len = obj_dir.norm();
+    return object->occluded(to_object.point(origin), (1.0 / len) * obj_dir, 
+    max_dist * len);
+}
+
+// Normals go through the inverse transpose of to_world
+vec3 Instance::normal_to_world(vec3 n) const
+{
+    vec3 result;
+    for (int i = 0; i < 3; i++)
+    {
+        result.coord[i] = to_object.m[0][i] * n.coord[0] + 
+        to_object.m[1][i] * n.coord[1] + to_object.m[2][i] * n.coord[2];
+    }
+    return result.normalize();
+}
+
+tlas::tlas(const std::vector<Instance> &instances)
+{
+    std::vector<BuildPrim> prims;
+    for (unsigned int i = 0; i < instances.size(); i++)
+    {
+        prims.push_back(build_prim(instances[i].minBounds, 
+        instances[i].maxBounds, i));
+    }
+    if (!prims.empty())
+    {
+        build_bvh(prims, 0, prims.size(), 1, 0, nodes);
+        minBounds = nodes[0].minBounds;
+        maxBounds = nodes[0].maxBounds;
+    }
+    slots.resize(prims.size());
+    for (unsigned int i = 0; i < prims.size(); i++)
+    {
+        this->instances.push_back(instances[prims[i].index]);
+        slots[prims[i].index] = i;
+    }
+    build_cost = bvh_cost(nodes);
+}
+
+void tlas::set_transform(unsigned int id, Transform to_world)
+{
+    instances[slots[id]].set_transform(to_world);
+}
+
+// Objects shared by the instances are updated by the caller first, this 
+// only refreshes the instance boxes and the nodes above them
+void tlas::refit()
+{
+    std::vector<std::pair<vec3, vec3>> prim_bounds;
+    prim_bounds.reserve(instances.size());
+    for (unsigned int i = 0; i < instances.size(); i++)
+    {
+        instances[i].set_transform(instances[i].to_world);
+        prim_bounds.push_back(std::make_pair(instances[i].minBounds, 
+        instances[i].maxBounds));
+    }
+    refit_nodes(nodes, prim_bounds);
+    if (!nodes.empty())
+    {
+        minBounds = nodes[0].minBounds;
+        maxBounds = nodes[0].maxBounds;
+    }
+}
+
+// Refits, and rebuilds from the instances in input order once the 
+// topology has gone bad so ids stay valid
+void tlas::update()
+{
+    refit();
+    if (bvh_cost(nodes) > BVH_REBUILD_RATIO * build_cost)
+    {
+        std::vector<Instance> by_id;
+        by_id.reserve(instances.size());
+        for (unsigned int i = 0; i < slots.size(); i++)
+        {
+            by_id.push_back(instances[slots[i]]);
+        }
+        *this = tlas(by_id);
+    }
+}
+
+// Each instance is only searched for hits closer than the best so far, 
+// and skipped when its box starts past that
+Hit tlas::intersect(vec3 origin, vec3 direction, float t_max) const
+{
+    Hit result;
+    vec4 inv_dir = vec4(direction).reciprocal();
+    vec4 ray_origin = vec4(origin);
+    float t_near;
+    if (nodes.empty() || 
+    !box_hit(nodes[0], ray_origin, inv_dir, t_max, t_near))
+    {
+        return result;
+    }
+    result.t = t_max;
+    unsigned int s[BVH_STACK_SIZE];
+    int stack_size = 0;
+    unsigned int n = 0;
+    while (true)
+    {
+        const BVHNode &node = nodes[n];
+        if (node.isLeaf())
+        {
+            for (unsigned int i = 0; i < node.num_prims; i++)
+            {
+                const Instance &instance = instances[node.offset + i];
+                if (aabb_intersection(instance.minBounds, instance.maxBounds, 
+                origin, direction).first >= result.t)
+                {
+                    continue;
+                }
+                Hit instance_hit = instance.intersect(origin, direction, 
+                result.t);
+                if (instance_hit.t < result.t)
+                {
+                    result = instance_hit;
+                }
+            }
+        }
+        else
+        {
+            unsigned int near = n + 1;
+            unsigned int far = node.offset;
+            float t_left;
+            float t_right;
+            bool hit_left = box_hit(nodes[near], ray_origin, inv_dir, result.t, 
+            t_left);
+            bool hit_right = box_hit(nodes[far], ray_origin, inv_dir, result.t, 
+            t_right);
+            if (hit_left && hit_right)
+            {
+                if (t_right < t_left)
+                {
+                    std::swap(near, far);
+                }
+                s[stack_size] = far;
+                stack_size++;
+                n = near;
+                continue;
+            }
+            else if (hit_left)
+            {
+                n = near;
+                continue;
+            }
+            else if (hit_right)
+            {
+                n = far;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+        {
+            return result.t < t_max ? result : Hit();
+        }
+        stack_size--;
+        n = s[stack_size];
+    }
+}
+
+bool tlas::occluded(vec3 origin, vec3 direction, float max_dist) const
+{
+    vec4 inv_dir = vec4(direction).reciprocal();
+    vec4 ray_origin = vec4(origin);
+    float t_near;
+    if (nodes.empty() || 
+    !box_hit(nodes[0], ray_origin, inv_dir, max_dist, t_near))
+    {
+        return false;
+    }
+    unsigned int s[BVH_STACK_SIZE];
+    int stack_size = 0;
+    unsigned int n = 0;
+    while (true)
+    {
+        const BVHNode &node = nodes[n];
+        if (node.isLeaf())
+        {
+            for (unsigned int i = 0; i < node.num_prims; i++)
+            {
+                if (instances[node.offset + i].occluded(origin, direction, 
+                max_dist))
+                {
+                    return true;
+                }
+            }
+        }
+        else
+        {
+            bool hit_left = box_hit(nodes[n + 1], ray_origin, inv_dir, 
+            max_dist, t_near);
+            bool hit_right = box_hit(nodes[node.offset], ray_origin, inv_dir, 
+            max_dist, t_near);
+            if (hit_left && hit_right)
+            {
+                s[stack_size] = node.offset;
+                stack_size++;
+                n = n + 1;
+                continue;
+            }
+            else if (hit_left)
+            {
+                n = n + 1;
+                continue;
+            }
+            else if (hit_right)
+            {
+                n = node.offset;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+        {
+            return false;
+        }
+        stack_size--;
+        n = s[stack_size];
+    }
+}
+
+std::shared_ptr<Accel> make_accel(std::string accel_type, 
+const PrimStore &store, int leaf_size, int max_depth, split_type mode)
+{
+    if (accel_type == "bvh")
+    {
+        return std::make_shared<bvh>(store, leaf_size);
+    }
+    else if (accel_type == "bvh4")
+    {
+        return std::make_shared<bvh4>(store, leaf_size);
+    }
+    std::pair<vec3, vec3> bounds = scene_extent(store);
+    return std::make_shared<kdtree>(bounds.first, bounds.second, store, 
+    leaf_size, max_depth, mode);
+}
+
+// Fills a box with count copies of object on a regular grid, each scaled 
+// down to fit its cell
+std::vector<Instance> instance_grid(std::shared_ptr<Accel> object, 
+vec3 minBounds, vec3 maxBounds, int count)
+{
+    std::vector<Instance> result;
+    int per_side = ceil(cbrt(count));
+    vec3 cell = (1.0 / per_side) * (maxBounds - minBounds);
+    vec3 size = object->maxBounds - object->minBounds;
+    vec3 object_center = .5 * (object->minBounds + object->maxBounds);
+    float scale = INFINITY;
+    for (int k = 0; k < 3; k++)
+    {
+        scale = std::min(scale, cell.coord[k] / size.coord[k]);
+    }
+    scale *= .8;
+    for (int i = 0; i < count; i++)
+    {
+        vec3 index = vec3(i % per_side, (i / per_side) % per_side, 
+        i / (per_side * per_side));
+        vec3 center = minBounds + (index + vec3(.5, .5, .5)).comp_mul(cell);
+        result.push_back(Instance(object, translate_scale(
+        center - scale * object_center, vec3(scale, scale, scale))));
+    }
+    return result;
+}
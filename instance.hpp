@@ -0,0 +1,106 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+#include <memory>
+#include <string>
+#include <vector>
+#include "vec3.hpp"
+#include "geometry.hpp"
+#include "accel.hpp"
+#include "kdtree.hpp"
+#include "bvh.hpp"
+
+// Affine map stored as the top three rows of a 4x4 matrix
+class Transform
+{
+    public:
+        float m[3][4];
+        // Identity
+        Transform()
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    m[i][j] = i == j;
+                }
+            }
+        }
+        vec3 point(vec3 p) const
+        {
+            return vector(p) + vec3(m[0][3], m[1][3], m[2][3]);
+        }
+        vec3 vector(vec3 v) const
+        {
+            vec3 result;
+            for (int i = 0; i < 3; i++)
+            {
+                result.coord[i] = m[i][0] * v.coord[0] + m[i][1] * v.coord[1] + 
+                m[i][2] * v.coord[2];
+            }
+            return result;
+        }
+        Transform inverse() const;
+};
+
+// Same placement add() bakes into triangles, scale then move to pos
+Transform translate_scale(vec3 pos, vec3 scaler);
+
+// Triangles of one .obj file in object space, centered on their center of 
+// mass, with their own tree. Any number of instances can share a mesh.
+class Mesh: public Accel
+{
+    public:
+        std::shared_ptr<TriMesh> geometry;
+        std::shared_ptr<Accel> tree;
+        Mesh(std::string path, material_id info, std::string accel_type, 
+        int leaf_size, bool compress = false);
+        Hit intersect(vec3 origin, vec3 direction, 
+        float t_max = INFINITY) const;
+        bool occluded(vec3 origin, vec3 direction, float max_dist) const;
+        void update();
+};
+
+// Placement of a shared object in the world. Rays are moved into object 
+// space, renormalized, and the hit distance scaled back to world space.
+class Instance
+{
+    public:
+        std::shared_ptr<Accel> object;
+        Transform to_world;
+        Transform to_object;
+        vec3 minBounds;
+        vec3 maxBounds;
+        Instance(std::shared_ptr<Accel> object, Transform to_world);
+        void set_transform(Transform to_world);
+        Hit intersect(vec3 origin, vec3 direction, 
+        float t_max = INFINITY) const;
+        bool occluded(vec3 origin, vec3 direction, float max_dist) const;
+        vec3 normal_to_world(vec3 n) const;
+};
+
+// BVH over instances, the top level of a two level scene. Instances are 
+// stored in leaf order, slots maps their position in the input to that.
+class tlas: public Accel
+{
+    public:
+        std::vector<Instance> instances;
+        std::vector<unsigned int> slots;
+        std::vector<BVHNode> nodes;
+        float build_cost;
+        tlas(const std::vector<Instance> &instances);
+        Hit intersect(vec3 origin, vec3 direction, 
+        float t_max = INFINITY) const;
+        bool occluded(vec3 origin, vec3 direction, float max_dist) const;
+        // Moves instance id, given in input order. Takes effect on update()
+        void set_transform(unsigned int id, Transform to_world);
+        void update();
+        void refit();
+};
+
+std::shared_ptr<Accel> make_accel(std::string accel_type, 
+const PrimStore &store, int leaf_size, int max_depth = 40, 
+split_type mode = SAH);
+
+std::vector<Instance> instance_grid(std::shared_ptr<Accel> object, 
+vec3 minBounds, vec3 maxBounds, int count);
+#endif
@@ -1,10 +1,11 @@
 #include "kdtree.hpp"
+#include <algorithm>
+#include <climits>
+#include <mutex>
 
-std::pair<vec3, vec3> split_point(vec3 minBounds, vec3 maxBounds, 
-const std::vector<Shape*> &scenery, int split_axis)
+std::pair<vec3, vec3> split_at(vec3 minBounds, vec3 maxBounds, 
+int split_axis, float loc)
 {
-    // Split halfway
-    float loc = .5 * (maxBounds.coord[split_axis] + minBounds.coord[split_axis]);
     std::pair<vec3, vec3> result;
     vec3 rmin = minBounds;
     vec3 lmax = maxBounds;
@@ -15,123 +16,995 @@ const std::vector<Shape*> &scenery, int split_axis)
     return result;
 }
 
-bool isLeaf(const std::vector<Shape*> &scenery, int leaf_size) 
+std::pair<vec3, vec3> split_point(vec3 minBounds, vec3 maxBounds, 
+int split_axis)
 {
-    return scenery.size() <= (unsigned int) leaf_size;
+    // Split halfway
+    float loc = .5 * (maxBounds.coord[split_axis] + minBounds.coord[split_axis]);
+    return split_at(minBounds, maxBounds, split_axis, loc);
 }
 
+bool event_order(const SplitEvent &left, const SplitEvent &right)
+{
+    if (left.axis != right.axis)
+    {
+        return left.axis < right.axis;
+    }
+    if (left.pos != right.pos)
+    {
+        return left.pos < right.pos;
+    }
+    return left.type < right.type;
+}
 
-Node init_node(vec3 minBounds, vec3 maxBounds, const std::vector<Shape*> 
-&scenery, int leaf_size, int depth, int max_depth)
+// Splits that leave one side empty get their cost scaled down so the tree
+// cuts off empty space early
+float sah_cost(float p_left, float p_right, int n_left, int n_right)
 {
-    Node result;
-    result.minBounds = minBounds;
-    result.maxBounds = maxBounds;
-    result.depth = depth;
-    if (isLeaf(scenery, leaf_size))
+    float cost = KD_TRAVERSAL_COST + KD_INTERSECT_COST * 
+    (p_left * n_left + p_right * n_right);
+    if (n_left == 0 || n_right == 0)
     {
-        result.isLeaf = true;
-        result.primitives = scenery;
-        result.left = NULL;
-        result.right = NULL;
+        cost *= KD_EMPTY_BONUS;
     }
-    else if (depth < max_depth)
+    return cost;
+}
+
+// Wald and Havran, "On building fast kd-Trees for Ray Tracing, and on doing
+// that in O(N log N)". Sweeps the sorted start/end events of the primitive
+// bounds clipped to the node, keeping counts of primitives on either side.
+// Returns false when no split is cheaper than making a leaf.
+bool sah_split(vec3 minBounds, vec3 maxBounds, const PrimStore &store, 
+const std::vector<unsigned int> &prims, int &split_axis, float &loc, 
+bool &planar_left)
+{
+    std::vector<SplitEvent> events;
+    events.reserve(6 * prims.size());
+    for (unsigned int i = 0; i < prims.size(); i++)
     {
-        std::vector<Shape*> l_prims;
-        std::vector<Shape*> r_prims;
-        int split_axis = rand() % 3;
-        std::pair<vec3, vec3> split = split_point(minBounds, maxBounds, 
-        scenery, split_axis);
+        std::pair<vec3, vec3> bound = store.bounds(prims[i]);
+        for (int k = 0; k < 3; k++)
+        {
+            float lo = std::max(bound.first.coord[k], minBounds.coord[k]);
+            float hi = std::min(bound.second.coord[k], maxBounds.coord[k]);
+            if (lo == hi)
+            {
+                events.push_back(SplitEvent{lo, k, PLANAR});
+            }
+            else
+            {
+                events.push_back(SplitEvent{lo, k, START});
+                events.push_back(SplitEvent{hi, k, END});
+            }
+        }
+    }
+    std::sort(events.begin(), events.end(), event_order);
 
-        // Check if split went too deep for floating point precision
-        if (minBounds == split.first || split.second == maxBounds)
+    int num_prims = prims.size();
+    int num_left[3] = {0, 0, 0};
+    int num_right[3] = {num_prims, num_prims, num_prims};
+    float total_area = surface_area(minBounds, maxBounds);
+    float best_cost = KD_INTERSECT_COST * num_prims;
+    bool found = false;
+    unsigned int i = 0;
+    while (i < events.size())
+    {
+        int axis = events[i].axis;
+        float pos = events[i].pos;
+        int ending = 0;
+        int planar = 0;
+        int starting = 0;
+        while (i < events.size() && events[i].axis == axis && 
+        events[i].pos == pos && events[i].type == END)
         {
-            result.isLeaf = true;
-            result.primitives = scenery;
-            result.left = NULL;
-            result.right = NULL;
+            ending++;
+            i++;
         }
-        else
+        while (i < events.size() && events[i].axis == axis && 
+        events[i].pos == pos && events[i].type == PLANAR)
+        {
+            planar++;
+            i++;
+        }
+        while (i < events.size() && events[i].axis == axis && 
+        events[i].pos == pos && events[i].type == START)
+        {
+            starting++;
+            i++;
+        }
+
+        num_right[axis] -= planar + ending;
+        if (pos > minBounds.coord[axis] && pos < maxBounds.coord[axis])
+        {
+            std::pair<vec3, vec3> split = split_at(minBounds, maxBounds, 
+            axis, pos);
+            float p_left = surface_area(minBounds, split.first) / total_area;
+            float p_right = surface_area(split.second, maxBounds) / 
+            total_area;
+            float cost_left = sah_cost(p_left, p_right, 
+            num_left[axis] + planar, num_right[axis]);
+            float cost_right = sah_cost(p_left, p_right, 
+            num_left[axis], num_right[axis] + planar);
+            float cost = std::min(cost_left, cost_right);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                split_axis = axis;
+                loc = pos;
+                planar_left = cost_left <= cost_right;
+                found = true;
+            }
+        }
+        num_left[axis] += starting + planar;
+    }
+    return found;
+}
+
+bool isLeaf(const std::vector<unsigned int> &prims, int leaf_size) 
+{
+    return prims.size() <= (unsigned int) leaf_size;
+}
+
+
+// Puts primitives that straddle the split in both children. With SAH, 
+// primitives whose clipped bounds lie on one side skip the overlap test.
+void partition(vec3 minBounds, vec3 maxBounds, std::pair<vec3, vec3> split, 
+const PrimStore &store, const std::vector<unsigned int> &prims, 
+int split_axis, bool planar_left, split_type mode, 
+std::vector<unsigned int> &l_prims, std::vector<unsigned int> &r_prims)
+{
+    float loc = split.first.coord[split_axis];
+    for (unsigned int i = 0; i < prims.size(); i++)
+    {
+        if (mode == SAH)
         {
-            result.isLeaf = false;
-            result.left = std::make_shared<Node>();
-            result.right = std::make_shared<Node>();
-            result.split_axis = split_axis;
-            for (unsigned int i = 0; i < scenery.size(); i++)
+            std::pair<vec3, vec3> bound = store.bounds(prims[i]);
+            float lo = std::max(bound.first.coord[split_axis], 
+            minBounds.coord[split_axis]);
+            float hi = std::min(bound.second.coord[split_axis], 
+            maxBounds.coord[split_axis]);
+            if (lo == hi && lo == loc)
             {
-                
-                if (scenery[i]->inBounds(minBounds, split.first))
+                if (planar_left)
                 {
-                    l_prims.push_back(scenery[i]);
+                    l_prims.push_back(prims[i]);
                 }
-                if (scenery[i]->inBounds(split.second, maxBounds))
+                else
                 {
-                    r_prims.push_back(scenery[i]);
+                    r_prims.push_back(prims[i]);
                 }
-
+                continue;
+            }
+            else if (hi <= loc)
+            {
+                l_prims.push_back(prims[i]);
+                continue;
+            }
+            else if (lo >= loc)
+            {
+                r_prims.push_back(prims[i]);
+                continue;
             }
-            *(result.left) = init_node(minBounds, split.first, l_prims, 
-            leaf_size, depth + 1, max_depth);
-            *(result.right) = init_node(split.second, maxBounds, r_prims, 
-            leaf_size, depth + 1, max_depth);
         }
+        if (store.inBounds(prims[i], minBounds, split.first))
+        {
+            l_prims.push_back(prims[i]);
+        }
+        if (store.inBounds(prims[i], split.second, maxBounds))
+        {
+            r_prims.push_back(prims[i]);
+        }
+    }
+}
 
+// Builds the subtree in place. Children holding more than KD_TASK_PRIMS 
+// primitives are built as OpenMP tasks. Every node's split only depends on 
+// its own primitives, so the tree is the same on any number of threads.
+void init_node(std::shared_ptr<Node> result, vec3 minBounds, vec3 maxBounds, 
+const PrimStore &store, const std::vector<unsigned int> &prims, 
+int leaf_size, int depth, int max_depth, split_type mode)
+{
+    result->minBounds = minBounds;
+    result->maxBounds = maxBounds;
+    result->depth = depth;
+    result->isLeaf = true;
+    result->left = NULL;
+    result->right = NULL;
+    if (isLeaf(prims, leaf_size) || depth >= max_depth)
+    {
+        result->primitives = prims;
+        return;
     }
 
+    int split_axis;
+    float loc;
+    bool planar_left = true;
+    if (mode == SAH)
+    {
+        if (!sah_split(minBounds, maxBounds, store, prims, split_axis, loc, 
+        planar_left))
+        {
+            result->primitives = prims;
+            return;
+        }
+    }
     else
     {
-        result.isLeaf = true;
-        result.left = NULL;
-        result.right = NULL;
-        result.primitives = scenery;
+        split_axis = longest_axis(minBounds, maxBounds);
+        loc = .5 * (maxBounds.coord[split_axis] + minBounds.coord[split_axis]);
     }
+    std::pair<vec3, vec3> split = split_at(minBounds, maxBounds, split_axis, 
+    loc);
 
-    return result;
+    // Check if split went too deep for floating point precision
+    if (minBounds == split.first || split.second == maxBounds)
+    {
+        result->primitives = prims;
+        return;
+    }
+
+    std::vector<unsigned int> l_prims;
+    std::vector<unsigned int> r_prims;
+    partition(minBounds, maxBounds, split, store, prims, split_axis, 
+    planar_left, mode, l_prims, r_prims);
+
+    result->isLeaf = false;
+    result->left = std::make_shared<Node>();
+    result->right = std::make_shared<Node>();
+    result->split_axis = split_axis;
+
+    # pragma omp task shared(store, l_prims) if(l_prims.size() > KD_TASK_PRIMS)
+    init_node(result->left, minBounds, split.first, store, l_prims, 
+    leaf_size, depth + 1, max_depth, mode);
+    # pragma omp task shared(store, r_prims) if(r_prims.size() > KD_TASK_PRIMS)
+    init_node(result->right, split.second, maxBounds, store, r_prims, 
+    leaf_size, depth + 1, max_depth, mode);
+    # pragma omp taskwait
 }
 
+// The Node graph only lives during the build, traversal, stats and the 
+// on-disk cache all use the flat arrays
 kdtree::kdtree(vec3 minBounds, vec3 maxBounds, const std::vector<Shape*> 
-&scenery, int leaf_size, int max_depth)
+&scenery, int leaf_size, int max_depth, split_type mode)
+    : kdtree(minBounds, maxBounds, PrimStore(scenery), leaf_size, max_depth, 
+    mode)
 {
-    root = std::make_shared<Node>();
-    this->max_depth = max_depth;
+}
+
+kdtree::kdtree(vec3 minBounds, vec3 maxBounds, const PrimStore &store, 
+int leaf_size, int max_depth, split_type mode)
+{
+    std::shared_ptr<Node> root = std::make_shared<Node>();
+    this->max_depth = std::min(max_depth, KD_MAX_DEPTH);
     this->leaf_size = leaf_size;
-    *root = init_node(minBounds, maxBounds, scenery, leaf_size, 0, max_depth);
+    this->mode = mode;
+    this->minBounds = minBounds;
+    this->maxBounds = maxBounds;
+    this->store = store;
+
+    # pragma omp parallel
+    # pragma omp single
+    init_node(root, minBounds, maxBounds, this->store, this->store.refs, 
+    leaf_size, 0, this->max_depth, mode);
+
+    flatten(root, *this);
+    // The packs are only built once the Node graph is gone, so the two 
+    // never take memory at the same time
+    root.reset();
+    build_packs(*this);
+    record_bounds();
+}
+
+// 64 bit FNV-1a of the corners of a box
+unsigned long long bounds_hash(std::pair<vec3, vec3> bound)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    const unsigned char *bytes[2] = {(const unsigned char *) bound.first.coord, 
+    (const unsigned char *) bound.second.coord};
+    for (int i = 0; i < 2; i++)
+    {
+        for (unsigned int j = 0; j < sizeof(bound.first.coord); j++)
+        {
+            h ^= bytes[i][j];
+            h *= 1099511628211ULL;
+        }
+    }
+    return h;
 }
 
+// Takes the current primitive bounds and SAH cost as the ones update() 
+// compares against
+void kdtree::record_bounds()
+{
+    prim_hashes.resize(store.refs.size());
+    for (unsigned int i = 0; i < store.refs.size(); i++)
+    {
+        prim_hashes[i] = bounds_hash(store.bounds(store.refs[i]));
+    }
+    build_cost = tree_stats(*this).sah_cost;
+}
 
-std::ostream& operator<<(std::ostream& os, const Node n)
+// Appends the subtree of node n of the old arrays as it was
+void copy_subtree(const std::vector<FlatNode> &nodes, 
+const std::vector<unsigned int> &indices, unsigned int n, kdtree &t)
 {
-    if (n.isLeaf)
+    unsigned int index = t.nodes.size();
+    t.nodes.push_back(nodes[n]);
+    if (nodes[n].isLeaf())
     {
-        os << "PRIM_SIZE " << n.primitives.size() << " MIN AND MAX " << 
-        n.minBounds << " " << n.maxBounds; 
+        const unsigned int *ids = &indices[nodes[n].prim_offset];
+        t.nodes[index].prim_offset = t.prim_indices.size();
+        t.prim_indices.insert(t.prim_indices.end(), ids, 
+        ids + nodes[n].num_prims());
     }
     else
     {
-        os << "SPLIT AXIS " << n.split_axis;
+        copy_subtree(nodes, indices, n + 1, t);
+        t.nodes[index].flags = (t.nodes.size() << 2) | nodes[n].split_axis();
+        copy_subtree(nodes, indices, nodes[n].right(), t);
     }
-    return os;
 }
 
-std::stringstream display(std::shared_ptr<Node> n)
+// Appends node n of the old arrays, where prims are the primitives that 
+// overlap its cell now. A subtree no moved primitive was in or is in now 
+// holds the same primitives as before and is copied. Otherwise an interior 
+// node keeps its split and hands its primitives down, and a leaf is split 
+// again from scratch. Which side a primitive lying in the split plane went 
+// to isn't stored, so those go to both.
+void repair(const std::vector<FlatNode> &nodes, 
+const std::vector<unsigned int> &indices, unsigned int n, vec3 minBounds, 
+vec3 maxBounds, int depth, const std::vector<unsigned int> &prims, 
+const std::vector<bool> &moved, const std::vector<bool> &moved_below, 
+kdtree &t)
 {
-    std::stringstream result;
+    bool dirty = moved_below[n];
+    for (unsigned int i = 0; i < prims.size() && !dirty; i++)
+    {
+        dirty = moved[t.store.position(prims[i])];
+    }
+    if (!dirty)
+    {
+        copy_subtree(nodes, indices, n, t);
+        return;
+    }
+    const FlatNode &node = nodes[n];
+    if (node.isLeaf())
+    {
+        std::shared_ptr<Node> sub = std::make_shared<Node>();
+        init_node(sub, minBounds, maxBounds, t.store, prims, t.leaf_size, 
+        depth, t.max_depth, t.mode);
+        flatten(sub, t);
+        return;
+    }
+    int axis = node.split_axis();
+    std::pair<vec3, vec3> split = split_at(minBounds, maxBounds, axis, 
+    node.split);
+    std::vector<unsigned int> l_prims;
+    std::vector<unsigned int> r_prims;
+    partition(minBounds, maxBounds, split, t.store, prims, axis, true, 
+    t.mode, l_prims, r_prims);
+    if (t.mode == SAH)
+    {
+        for (unsigned int i = 0; i < l_prims.size(); i++)
+        {
+            std::pair<vec3, vec3> bound = t.store.bounds(l_prims[i]);
+            if (bound.first.coord[axis] == node.split && 
+            bound.second.coord[axis] == node.split)
+            {
+                r_prims.push_back(l_prims[i]);
+            }
+        }
+    }
+    unsigned int index = t.nodes.size();
+    t.nodes.push_back(node);
+    repair(nodes, indices, n + 1, minBounds, split.first, depth + 1, l_prims, 
+    moved, moved_below, t);
+    t.nodes[index].flags = (t.nodes.size() << 2) | axis;
+    repair(nodes, indices, node.right(), split.second, maxBounds, depth + 1, 
+    r_prims, moved, moved_below, t);
+}
+
+// Split planes cut space rather than bounding primitives, so a kd-tree 
+// can't be refitted. Only the subtrees moved primitives left or entered 
+// are rebuilt, keeping the splits above them, and the whole tree is rebuilt 
+// once its SAH cost has grown KD_REBUILD_RATIO past the last full build. 
+// The bounds only ever grow so primitives that moved out of the old box 
+// are still found.
+void kdtree::update()
+{
+    vec3 new_min = minBounds;
+    vec3 new_max = maxBounds;
+    store.sync();
+    std::vector<bool> moved(store.refs.size(), false);
+    bool any_moved = false;
+    for (unsigned int i = 0; i < store.refs.size(); i++)
+    {
+        std::pair<vec3, vec3> bound = store.bounds(store.refs[i]);
+        for (int k = 0; k < 3; k++)
+        {
+            new_min.coord[k] = std::min(new_min.coord[k], bound.first.coord[k]);
+            new_max.coord[k] = std::max(new_max.coord[k], 
+            bound.second.coord[k]);
+        }
+        unsigned long long h = bounds_hash(bound);
+        if (h != prim_hashes[i])
+        {
+            prim_hashes[i] = h;
+            moved[i] = true;
+            any_moved = true;
+        }
+    }
+    if (!any_moved)
+    {
+        return;
+    }
+
+    std::vector<FlatNode> old_nodes;
+    std::vector<unsigned int> old_indices;
+    old_nodes.swap(nodes);
+    old_indices.swap(prim_indices);
+    // Children come after their parent, so walking backwards finishes both 
+    // before the node that contains them
+    std::vector<bool> moved_below(old_nodes.size(), false);
+    for (int n = old_nodes.size() - 1; n >= 0; n--)
+    {
+        const FlatNode &node = old_nodes[n];
+        if (node.isLeaf())
+        {
+            for (unsigned int i = 0; i < node.num_prims(); i++)
+            {
+                if (moved[store.position(old_indices[node.prim_offset + i])])
+                {
+                    moved_below[n] = true;
+                    break;
+                }
+            }
+        }
+        else
+        {
+            moved_below[n] = moved_below[n + 1] || moved_below[node.right()];
+        }
+    }
+    minBounds = new_min;
+    maxBounds = new_max;
+    # pragma omp parallel
+    # pragma omp single
+    repair(old_nodes, old_indices, 0, minBounds, maxBounds, 0, store.refs, 
+    moved, moved_below, *this);
+
+    if (tree_stats(*this).sah_cost > KD_REBUILD_RATIO * build_cost)
+    {
+        *this = kdtree(minBounds, maxBounds, store, leaf_size, max_depth, mode);
+        return;
+    }
+    build_packs(*this);
+}
+
+// Appends the subtree in depth first order, left child first
+void flatten(std::shared_ptr<Node> n, kdtree &t)
+{
+    unsigned int index = t.nodes.size();
+    t.nodes.push_back(FlatNode());
     if (n->isLeaf)
     {
-        result << *n;
+        t.nodes[index].prim_offset = t.prim_indices.size();
+        t.nodes[index].flags = (n->primitives.size() << 2) | 3;
+        t.prim_indices.insert(t.prim_indices.end(), n->primitives.begin(), 
+        n->primitives.end());
     }
     else
     {
-        result << "[" << *n << " [" << display(n->left).str() << "] [" << 
-        display(n->right).str() << "]]";
+        t.nodes[index].split = n->left->maxBounds.coord[n->split_axis];
+        flatten(n->left, t);
+        t.nodes[index].flags = (t.nodes.size() << 2) | n->split_axis;
+        flatten(n->right, t);
+    }
+}
+
+// Orders the primitives of every leaf and packs them, see LeafPacks. Safe 
+// to run again on a tree loaded from disk.
+void build_packs(kdtree &t)
+{
+    t.packed.clear();
+    t.leaf_packs.assign(t.nodes.size(), LeafPacks());
+    for (unsigned int n = 0; n < t.nodes.size(); n++)
+    {
+        if (t.nodes[n].isLeaf())
+        {
+            t.leaf_packs[n] = t.packed.add(t.store, 
+            &t.prim_indices[t.nodes[n].prim_offset], t.nodes[n].num_prims());
+        }
+    }
+}
+
+std::pair<unsigned int, unsigned int> order(vec3 dir, unsigned int n, 
+const kdtree &t)
+{
+    std::pair<unsigned int, unsigned int> result;
+    const FlatNode &node = t.nodes[n];
+    if (dir.coord[node.split_axis()] > 0)
+    {
+        result.first = n + 1;
+        result.second = node.right();
+    }
+    else
+    {
+        result.first = node.right();
+        result.second = n + 1;
     }
     return result;
 }
 
-std::ostream& operator<<(std::ostream& os, const kdtree t)
+// Puts the primitives of a pack, given by its ids, in the mailbox. Returns 
+// false when the ray already tested all of them, so the pack can be skipped.
+// Otherwise every lane is tested again, so only whole packs count as skips.
+bool check_mailbox(const unsigned int *pack_ids, unsigned int *mailbox, 
+kd_trace_stats &counts)
+{
+    int lanes = 0;
+    int fresh = 0;
+    for (int lane = 0; lane < PACK_WIDTH && pack_ids[lane] != PACK_EMPTY; 
+    lane++)
+    {
+        unsigned int &slot = mailbox[pack_ids[lane] & (KD_MAILBOX_SIZE - 1)];
+        lanes++;
+        if (slot != pack_ids[lane])
+        {
+            slot = pack_ids[lane];
+            fresh++;
+        }
+    }
+    if (fresh == 0)
+    {
+        counts.mailbox_skips += lanes;
+        return false;
+    }
+    counts.pack_tests++;
+    counts.prim_tests += lanes;
+    counts.redundant_lanes += lanes - fresh;
+    return true;
+}
+
+// Walks the tree front to back keeping the far children still to visit on a 
+// fixed size stack. A leaf hit closer than the end of the current segment
+// can't be beaten by anything further along the ray.
+// Primitives straddling a split are referenced by several leaves. Their 
+// ids go in a small mailbox so a ray tests each one once, which is safe 
+// because result keeps hits past the current leaf too. Only hits closer 
+// than max_dist are kept.
+Hit searchNode(const kdtree &t, vec3 origin, 
+vec3 direction, float t_min, float t_max, float max_dist, 
+kd_trace_stats &counts)
 {
-    os << display(t.root).str();
+    Ray ray(origin, direction);
+    NodeStack s[KD_MAX_DEPTH];
+    int stack_size = 0;
+    unsigned int n = 0;
+    Hit result;
+    result.t = max_dist;
+    unsigned int mailbox[KD_MAILBOX_SIZE];
+    std::fill(mailbox, mailbox + KD_MAILBOX_SIZE, UINT_MAX);
+    while (true)
+    {
+        const FlatNode &node = t.nodes[n];
+        counts.nodes++;
+        if (node.isLeaf())
+        {
+            const unsigned int *ids = &t.prim_indices[node.prim_offset];
+            const LeafPacks &leaf = t.leaf_packs[n];
+            counts.leaves++;
+            for (unsigned int p = 0; p < leaf.num_packs; p++)
+            {
+                const TrianglePack &pack = t.packed.packs[leaf.offset + p];
+                if (!check_mailbox(pack.id, mailbox, counts))
+                {
+                    continue;
+                }
+                float intersect;
+                float u;
+                float v;
+                int lane = pack_intersection(pack, ray, result.t, intersect, 
+                u, v);
+                if (lane >= 0)
+                {
+                    result.t = intersect;
+                    t.store.set_hit(result, pack.id[lane], u, v);
+                }
+            }
+            for (unsigned int p = 0; p < leaf.num_mesh_packs; p++)
+            {
+                const MeshPack &pack = 
+                t.packed.mesh_packs[leaf.mesh_offset + p];
+                if (!check_mailbox(pack.id, mailbox, counts))
+                {
+                    continue;
+                }
+                float intersect;
+                float u;
+                float v;
+                int lane = mesh_pack_intersection(pack, *t.store.mesh, ray, 
+                result.t, intersect, u, v);
+                if (lane >= 0)
+                {
+                    result.t = intersect;
+                    t.store.set_hit(result, pack.id[lane], u, v);
+                }
+            }
+            for (unsigned int p = 0; p < leaf.num_sphere_packs; p++)
+            {
+                const SpherePack &pack = 
+                t.packed.sphere_packs[leaf.sphere_offset + p];
+                if (!check_mailbox(pack.id, mailbox, counts))
+                {
+                    continue;
+                }
+                float intersect;
+                int lane = sphere_pack_intersection(pack, ray, result.t, 
+                intersect);
+                if (lane >= 0)
+                {
+                    result.t = intersect;
+                    t.store.set_hit(result, pack.id[lane], 0, 0);
+                }
+            }
+            for (unsigned int i = leaf.num_packed(); i < node.num_prims(); 
+            i++)
+            {
+                unsigned int &slot = mailbox[ids[i] & (KD_MAILBOX_SIZE - 1)];
+                if (slot == ids[i])
+                {
+                    counts.mailbox_skips++;
+                    continue;
+                }
+                slot = ids[i];
+                counts.prim_tests++;
+                float u = 0;
+                float v = 0;
+                float intersect = t.store.intersection(ids[i], ray, u, v);
+                if (intersect < result.t)
+                {
+                    result.t = intersect;
+                    t.store.set_hit(result, ids[i], u, v);
+                }
+            }
+            if (result.t < t_max)
+            {
+                return result;
+            }
+            else if (stack_size == 0)
+            {
+                return Hit();
+            }
+            stack_size--;
+            n = s[stack_size].n;
+            t_min = s[stack_size].t_min;
+            t_max = s[stack_size].t_max;
+        }
+        else
+        {
+            // Coordinate of split is on the split_axis dimension and equal to 
+            // the maxBounds of the left node or minBound of right node
+            int axis = node.split_axis();
+            float inverse_coord = 1.0 / direction.coord[axis];
+            float t_hit = (node.split - origin.coord[axis]) * inverse_coord;
+
+            std::pair<unsigned int, unsigned int> ordered = 
+            order(direction, n, t);
+
+            if (t_hit < t_min)
+            {
+                n = ordered.second;
+            }
+            else if (t_hit > t_max)
+            {
+                n = ordered.first;
+            }
+            else
+            {
+                s[stack_size].n = ordered.second;
+                s[stack_size].t_min = t_hit;
+                s[stack_size].t_max = t_max;
+                stack_size++;
+                n = ordered.first;
+                t_max = t_hit;
+            }
+        }
+    }
+}
+
+Hit kdtree::intersect(vec3 origin, vec3 direction, float t_max) const
+{
+    std::pair<float, float> t_bounds = aabb_intersection(minBounds, 
+    maxBounds, origin, direction);
+    Hit result;
+    kd_trace_stats counts;
+    counts.rays = 1;
+    if (!std::isinf(t_bounds.first) && t_bounds.second >= 0 && 
+    t_bounds.first < t_max)
+    {
+        result = searchNode(*this, origin, direction, 
+        std::max(t_bounds.first, 0.0f), std::min(t_bounds.second, t_max), 
+        t_max, counts);
+    }
+    add_trace_stats(counts);
+    return result;
+}
+
+
+// Any hit closer than max_dist blocks the ray, so unlike searchNode this 
+// returns on the first one found and never visits nodes past max_dist
+bool kdtree::occluded(vec3 origin, vec3 direction, float max_dist) const
+{
+    std::pair<float, float> t_bounds = aabb_intersection(minBounds, 
+    maxBounds, origin, direction);
+    kd_trace_stats counts;
+    counts.rays = 1;
+    if (std::isinf(t_bounds.first) || t_bounds.second < 0 || 
+    t_bounds.first > max_dist)
+    {
+        add_trace_stats(counts);
+        return false;
+    }
+    Ray ray(origin, direction);
+    NodeStack s[KD_MAX_DEPTH];
+    int stack_size = 0;
+    unsigned int n = 0;
+    float t_min = std::max(t_bounds.first, 0.0f);
+    float t_max = std::min(t_bounds.second, max_dist);
+    unsigned int mailbox[KD_MAILBOX_SIZE];
+    std::fill(mailbox, mailbox + KD_MAILBOX_SIZE, UINT_MAX);
+    while (true)
+    {
+        const FlatNode &node = nodes[n];
+        counts.nodes++;
+        if (node.isLeaf())
+        {
+            const unsigned int *ids = &prim_indices[node.prim_offset];
+            const LeafPacks &leaf = leaf_packs[n];
+            counts.leaves++;
+            for (unsigned int p = 0; p < leaf.num_packs; p++)
+            {
+                const TrianglePack &pack = packed.packs[leaf.offset + p];
+                float intersect;
+                float u;
+                float v;
+                if (check_mailbox(pack.id, mailbox, counts) && 
+                pack_intersection(pack, ray, max_dist, intersect, u, v) >= 0)
+                {
+                    add_trace_stats(counts);
+                    return true;
+                }
+            }
+            for (unsigned int p = 0; p < leaf.num_mesh_packs; p++)
+            {
+                const MeshPack &pack = packed.mesh_packs[leaf.mesh_offset + p];
+                float intersect;
+                float u;
+                float v;
+                if (check_mailbox(pack.id, mailbox, counts) && 
+                mesh_pack_intersection(pack, *store.mesh, ray, max_dist, 
+                intersect, u, v) >= 0)
+                {
+                    add_trace_stats(counts);
+                    return true;
+                }
+            }
+            for (unsigned int p = 0; p < leaf.num_sphere_packs; p++)
+            {
+                const SpherePack &pack = 
+                packed.sphere_packs[leaf.sphere_offset + p];
+                float intersect;
+                if (check_mailbox(pack.id, mailbox, counts) && 
+                sphere_pack_intersection(pack, ray, max_dist, intersect) >= 0)
+                {
+                    add_trace_stats(counts);
+                    return true;
+                }
+            }
+            for (unsigned int i = leaf.num_packed(); i < node.num_prims(); 
+            i++)
+            {
+                unsigned int &slot = mailbox[ids[i] & (KD_MAILBOX_SIZE - 1)];
+                if (slot == ids[i])
+                {
+                    counts.mailbox_skips++;
+                    continue;
+                }
+                slot = ids[i];
+                counts.prim_tests++;
+                if (store.intersection(ids[i], ray) < max_dist)
+                {
+                    add_trace_stats(counts);
+                    return true;
+                }
+            }
+            if (stack_size == 0)
+            {
+                add_trace_stats(counts);
+                return false;
+            }
+            stack_size--;
+            n = s[stack_size].n;
+            t_min = s[stack_size].t_min;
+            t_max = s[stack_size].t_max;
+        }
+        else
+        {
+            int axis = node.split_axis();
+            float inverse_coord = 1.0 / direction.coord[axis];
+            float t_hit = (node.split - origin.coord[axis]) * inverse_coord;
+
+            std::pair<unsigned int, unsigned int> ordered = 
+            order(direction, n, *this);
+
+            if (t_hit < t_min)
+            {
+                n = ordered.second;
+            }
+            else if (t_hit > t_max)
+            {
+                n = ordered.first;
+            }
+            else
+            {
+                s[stack_size].n = ordered.second;
+                s[stack_size].t_min = t_hit;
+                s[stack_size].t_max = t_max;
+                stack_size++;
+                n = ordered.first;
+                t_max = t_hit;
+            }
+        }
+    }
+}
+
+void node_stats(const kdtree &t, unsigned int n, vec3 minBounds, 
+vec3 maxBounds, int depth, float root_area, kd_stats &s)
+{
+    const FlatNode &node = t.nodes[n];
+    float p_hit = surface_area(minBounds, maxBounds) / root_area;
+    s.nodes += 1;
+    s.max_depth = std::max(s.max_depth, depth);
+    if (node.isLeaf())
+    {
+        s.leaves += 1;
+        s.empty_leaves += node.num_prims() == 0;
+        s.prim_refs += node.num_prims();
+        s.sah_cost += p_hit * KD_INTERSECT_COST * node.num_prims();
+    }
+    else
+    {
+        std::pair<vec3, vec3> split = split_at(minBounds, maxBounds, 
+        node.split_axis(), node.split);
+        s.sah_cost += p_hit * KD_TRAVERSAL_COST;
+        node_stats(t, n + 1, minBounds, split.first, depth + 1, root_area, s);
+        node_stats(t, node.right(), split.second, maxBounds, depth + 1, 
+        root_area, s);
+    }
+}
+
+kd_stats tree_stats(const kdtree &t)
+{
+    kd_stats result{0, 0, 0, 0, 0, 0, t.packed.bytes(), 
+    t.store.mesh ? t.store.mesh->bytes() : 0};
+    node_stats(t, 0, t.minBounds, t.maxBounds, 0, 
+    surface_area(t.minBounds, t.maxBounds), result);
+    return result;
+}
+
+std::stringstream display(const kdtree &t, unsigned int n, vec3 minBounds, 
+vec3 maxBounds)
+{
+    std::stringstream result;
+    const FlatNode &node = t.nodes[n];
+    if (node.isLeaf())
+    {
+        result << "PRIM_SIZE " << node.num_prims() << " MIN AND MAX " << 
+        minBounds << " " << maxBounds; 
+    }
+    else
+    {
+        std::pair<vec3, vec3> split = split_at(minBounds, maxBounds, 
+        node.split_axis(), node.split);
+        result << "[SPLIT AXIS " << node.split_axis() << " [" << 
+        display(t, n + 1, minBounds, split.first).str() << "] [" << 
+        display(t, node.right(), split.second, maxBounds).str() << "]]";
+    }
+    return result;
+}
+
+std::ostream& operator<<(std::ostream& os, const kdtree &t)
+{
+    os << display(t, 0, t.minBounds, t.maxBounds).str();
     return os;
 }
 
+kd_trace_stats& kd_trace_stats::operator+=(const kd_trace_stats &s)
+{
+    rays += s.rays;
+    nodes += s.nodes;
+    leaves += s.leaves;
+    prim_tests += s.prim_tests;
+    pack_tests += s.pack_tests;
+    mailbox_skips += s.mailbox_skips;
+    redundant_lanes += s.redundant_lanes;
+    return *this;
+}
+
+// Counters of one thread. Live ones are listed so traversal_stats() can 
+// find them, and fold their counts into retired_stats when the thread ends.
+class TraceStatsSlot
+{
+    public:
+        kd_trace_stats stats;
+        TraceStatsSlot();
+        ~TraceStatsSlot();
+};
+
+static std::mutex trace_stats_mutex;
+static std::vector<TraceStatsSlot*> trace_stats_slots;
+static kd_trace_stats retired_stats;
+static thread_local TraceStatsSlot thread_stats;
+
+TraceStatsSlot::TraceStatsSlot()
+{
+    std::lock_guard<std::mutex> lock(trace_stats_mutex);
+    trace_stats_slots.push_back(this);
+}
+
+TraceStatsSlot::~TraceStatsSlot()
+{
+    std::lock_guard<std::mutex> lock(trace_stats_mutex);
+    retired_stats += stats;
+    trace_stats_slots.erase(std::find(trace_stats_slots.begin(), 
+    trace_stats_slots.end(), this));
+}
+
+void add_trace_stats(const kd_trace_stats &counts)
+{
+    thread_stats.stats += counts;
+}
+
+kd_trace_stats traversal_stats()
+{
+    std::lock_guard<std::mutex> lock(trace_stats_mutex);
+    kd_trace_stats result = retired_stats;
+    for (unsigned int i = 0; i < trace_stats_slots.size(); i++)
+    {
+        result += trace_stats_slots[i]->stats;
+    }
+    return result;
+}
+
+void reset_traversal_stats()
+{
+    std::lock_guard<std::mutex> lock(trace_stats_mutex);
+    retired_stats = kd_trace_stats();
+    for (unsigned int i = 0; i < trace_stats_slots.size(); i++)
+    {
+        trace_stats_slots[i]->stats = kd_trace_stats();
+    }
+}
+
+std::ostream& operator<<(std::ostream& os, const kd_stats s)
+{
+    os << "NODES " << s.nodes << " LEAVES " << s.leaves << " EMPTY " << 
+    s.empty_leaves << " DEPTH " << s.max_depth << " PRIM_REFS " << 
+    s.prim_refs << " PRIMS_PER_LEAF " << 
+    float(s.prim_refs) / (s.leaves - s.empty_leaves) << " SAH_COST " << 
+    s.sah_cost << " PACK_BYTES " << s.pack_bytes << " MESH_BYTES " << 
+    s.mesh_bytes;
+    return os;
+}
 
+std::ostream& operator<<(std::ostream& os, const kd_trace_stats s)
+{
+    os << "RAYS " << s.rays << " NODES_PER_RAY " << 
+    double(s.nodes) / s.rays << " LEAVES_PER_RAY " << 
+    double(s.leaves) / s.rays << " TESTS_PER_RAY " << 
+    double(s.prim_tests) / s.rays << " PACK_TESTS_PER_RAY " << 
+    double(s.pack_tests) / s.rays << " MAILBOX_SKIPS " << s.mailbox_skips << 
+    " (" << 100.0 * s.mailbox_skips / (s.prim_tests + s.mailbox_skips) << 
+    "% of tests) REDUNDANT_LANES " << s.redundant_lanes;
+    return os;
+}
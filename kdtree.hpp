@@ -5,12 +5,32 @@
 #include <sstream>
 #include <memory>
 #include "geometry.hpp"
+#include "accel.hpp"
+#include "prim_store.hpp"
+#include "leaf_packs.hpp"
+#define KD_TRAVERSAL_COST 1.0
+#define KD_INTERSECT_COST 1.5
+#define KD_EMPTY_BONUS .8
+// Upper bound on tree depth, sizes the traversal stack
+#define KD_MAX_DEPTH 64
+// Subtrees with more primitives than this are built as separate tasks
+#define KD_TASK_PRIMS 1024
+// Recently tested primitives remembered per ray, a power of two
+#define KD_MAILBOX_SIZE 8
+// Updated trees are rebuilt once their SAH cost grows past this factor of 
+// the cost they were built with
+#define KD_REBUILD_RATIO 1.5
+
+// MIDPOINT splits the longest axis halfway, SAH picks the axis and position
+// with the lowest surface area heuristic cost
+enum split_type {MIDPOINT, SAH};
 
 class Node
 {
     public:
         bool isLeaf;
-        std::vector<Shape*> primitives;
+        // References into the tree's store
+        std::vector<unsigned int> primitives;
         std::shared_ptr<Node> left;
         std::shared_ptr<Node> right;
         vec3 minBounds;
@@ -19,28 +39,189 @@ class Node
         int depth;
 };
 
+// Candidate split plane where a primitive's clipped bounds start or end,
+// or where a primitive flat in that axis lies
+enum event_type {END, PLANAR, START};
+
+class SplitEvent
+{
+    public:
+        float pos;
+        int axis;
+        event_type type;
+};
+
+// Compact node used for traversal. The left child of an interior node 
+// directly follows it in the node array, the right child is stored by index.
+// Leaves hold a range of the tree's primitive index array.
+class FlatNode
+{
+    public:
+        union
+        {
+            float split;
+            unsigned int prim_offset;
+        };
+        // Low two bits are the split axis, or 3 for a leaf. The remaining 
+        // bits are the right child index or the leaf primitive count
+        unsigned int flags;
+        bool isLeaf() const
+        {
+            return (flags & 3) == 3;
+        }
+        int split_axis() const
+        {
+            return flags & 3;
+        }
+        unsigned int right() const
+        {
+            return flags >> 2;
+        }
+        unsigned int num_prims() const
+        {
+            return flags >> 2;
+        }
+};
+
+class NodeStack
+{
+    public:
+        unsigned int n;
+        float t_min;
+        float t_max;
+};
 
-class kdtree
+class kdtree: public Accel
 {
     public:
         int leaf_size;
         int max_depth;
-        std::shared_ptr<Node> root;
+        split_type mode;
+        PrimStore store;
+        std::vector<FlatNode> nodes;
+        // References into store, see prim_ref()
+        std::vector<unsigned int> prim_indices;
+        PackedLeaves packed;
+        // Indexed like nodes, only leaves use theirs
+        std::vector<LeafPacks> leaf_packs;
+        // Hash of the bounds of every primitive as the tree last saw them, 
+        // indexed like store.refs, so update() can tell which ones moved
+        std::vector<unsigned long long> prim_hashes;
+        float build_cost;
+        // Empty tree, filled in by load_tree()
+        kdtree()
+        {
+        }
         kdtree(vec3 minBounds, vec3 maxBounds, 
-        const std::vector<Shape*> &scenery, int leaf_size, int max_depth);
+        const std::vector<Shape*> &scenery, int leaf_size, int max_depth, 
+        split_type mode = SAH);
+        kdtree(vec3 minBounds, vec3 maxBounds, const PrimStore &store, 
+        int leaf_size, int max_depth, split_type mode = SAH);
+        Hit intersect(vec3 origin, vec3 direction, 
+        float t_max = INFINITY) const;
+        bool occluded(vec3 origin, vec3 direction, float max_dist) const;
+        void update();
+        void record_bounds();
+};
+
+class kd_stats
+{
+    public:
+        int nodes;
+        int leaves;
+        int empty_leaves;
+        int max_depth;
+        long prim_refs;
+        float sah_cost;
+        // Memory of the leaf packs and of the mesh they reference
+        size_t pack_bytes;
+        size_t mesh_bytes;
 };
 
+// Traversal counters. Each thread adds its rays to its own copy, 
+// traversal_stats() sums them and is meant to be read between renders.
+class kd_trace_stats
+{
+    public:
+        unsigned long long rays;
+        unsigned long long nodes;
+        unsigned long long leaves;
+        unsigned long long prim_tests;
+        unsigned long long pack_tests;
+        // Tests skipped because the ray already tried that primitive
+        unsigned long long mailbox_skips;
+        // Lanes of tested packs that held a primitive the ray already 
+        // tried, the pack went through the kernel for its other lanes
+        unsigned long long redundant_lanes;
+        kd_trace_stats()
+        {
+            rays = 0;
+            nodes = 0;
+            leaves = 0;
+            prim_tests = 0;
+            pack_tests = 0;
+            mailbox_skips = 0;
+            redundant_lanes = 0;
+        }
+        kd_trace_stats& operator+=(const kd_trace_stats &s);
+};
+
+std::pair<vec3, vec3> split_at(vec3 minBounds, vec3 maxBounds, 
+int split_axis, float loc);
+
 std::pair<vec3, vec3> split_point(vec3 minBounds, vec3 maxBounds, 
-const std::vector<Shape*> &scenery, int split_axis);
+int split_axis);
+
+bool sah_split(vec3 minBounds, vec3 maxBounds, const PrimStore &store, 
+const std::vector<unsigned int> &prims, int &split_axis, float &loc, 
+bool &planar_left);
+
+void init_node(std::shared_ptr<Node> result, vec3 minBounds, vec3 maxBounds, 
+const PrimStore &store, const std::vector<unsigned int> &prims, 
+int leaf_size, int depth, int max_depth, split_type mode);
+
+void flatten(std::shared_ptr<Node> n, kdtree &t);
+
+unsigned long long bounds_hash(std::pair<vec3, vec3> bound);
+
+void copy_subtree(const std::vector<FlatNode> &nodes, 
+const std::vector<unsigned int> &indices, unsigned int n, kdtree &t);
+
+void repair(const std::vector<FlatNode> &nodes, 
+const std::vector<unsigned int> &indices, unsigned int n, vec3 minBounds, 
+vec3 maxBounds, int depth, const std::vector<unsigned int> &prims, 
+const std::vector<bool> &moved, const std::vector<bool> &moved_below, 
+kdtree &t);
+
+void build_packs(kdtree &t);
+
+std::pair<unsigned int, unsigned int> order(vec3 dir, unsigned int n, 
+const kdtree &t);
+
+bool check_mailbox(const unsigned int *pack_ids, unsigned int *mailbox, 
+kd_trace_stats &counts);
+
+Hit searchNode(const kdtree &t, vec3 origin, 
+vec3 direction, float t_min, float t_max, float max_dist, 
+kd_trace_stats &counts);
+
+void add_trace_stats(const kd_trace_stats &counts);
+
+kd_trace_stats traversal_stats();
+
+void reset_traversal_stats();
 
+kd_stats tree_stats(const kdtree &t);
 
-Node init_node(vec3 minBounds, vec3 maxBounds, const std::vector<Shape*> 
-&scenery, int leaf_size, int depth, int max_depth);
+void node_stats(const kdtree &t, unsigned int n, vec3 minBounds, 
+vec3 maxBounds, int depth, float root_area, kd_stats &s);
 
+std::stringstream display(const kdtree &t, unsigned int n, vec3 minBounds, 
+vec3 maxBounds);
 
-std::ostream& operator<<(std::ostream& os, const Node n);
+std::ostream& operator<<(std::ostream& os, const kdtree &t);
 
-std::stringstream display(std::shared_ptr<Node> n);
+std::ostream& operator<<(std::ostream& os, const kd_stats s);
 
-std::ostream& operator<<(std::ostream& os, const kdtree t);
+std::ostream& operator<<(std::ostream& os, const kd_trace_stats s);
 #endif
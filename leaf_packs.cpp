@@ -0,0 +1,173 @@
+#include "leaf_packs.hpp"
+#include <algorithm>
+
+void PackedLeaves::clear()
+{
+    packs.clear();
+    mesh_packs.clear();
+    sphere_packs.clear();
+}
+
+bool is_triangle(unsigned int ref)
+{
+    return ref_type(ref) == TRIANGLE;
+}
+
+bool is_mesh_triangle(unsigned int ref)
+{
+    return ref_type(ref) == MESH_TRIANGLE;
+}
+
+LeafPacks PackedLeaves::add(const PrimStore &store, unsigned int *ids, 
+unsigned int num_prims)
+{
+    LeafPacks result;
+    unsigned int num_tris = std::stable_partition(ids, ids + num_prims, 
+    is_triangle) - ids;
+    result.offset = packs.size();
+    result.num_packs = (num_tris + PACK_WIDTH - 1) / PACK_WIDTH;
+    result.num_tris = num_tris;
+    for (unsigned int i = 0; i < num_tris; i += PACK_WIDTH)
+    {
+        TriangleVerts tris[PACK_WIDTH];
+        int count = std::min(num_tris - i, (unsigned int)PACK_WIDTH);
+        for (int lane = 0; lane < count; lane++)
+        {
+            tris[lane] = store.corners(ids[i + lane]);
+        }
+        packs.push_back(make_pack(tris, ids + i, count));
+    }
+
+    unsigned int *mesh_ids = ids + num_tris;
+    unsigned int num_mesh_tris = std::stable_partition(mesh_ids, 
+    ids + num_prims, is_mesh_triangle) - mesh_ids;
+    result.mesh_offset = mesh_packs.size();
+    result.num_mesh_packs = (num_mesh_tris + PACK_WIDTH - 1) / PACK_WIDTH;
+    result.num_mesh_tris = num_mesh_tris;
+    for (unsigned int i = 0; i < num_mesh_tris; i += PACK_WIDTH)
+    {
+        int count = std::min(num_mesh_tris - i, (unsigned int)PACK_WIDTH);
+        mesh_packs.push_back(make_mesh_pack(*store.mesh, mesh_ids + i, count));
+    }
+
+    unsigned int *sphere_ids = mesh_ids + num_mesh_tris;
+    unsigned int num_spheres = std::stable_partition(sphere_ids, 
+    ids + num_prims, PrimStore::is_sphere) - sphere_ids;
+    result.sphere_offset = sphere_packs.size();
+    result.num_sphere_packs = (num_spheres + PACK_WIDTH - 1) / PACK_WIDTH;
+    result.num_spheres = num_spheres;
+    for (unsigned int i = 0; i < num_spheres; i += PACK_WIDTH)
+    {
+        vec3 centers[PACK_WIDTH];
+        float radii[PACK_WIDTH];
+        int count = std::min(num_spheres - i, (unsigned int)PACK_WIDTH);
+        for (int lane = 0; lane < count; lane++)
+        {
+            std::pair<vec3, float> ball = store.ball(sphere_ids[i + lane]);
+            centers[lane] = ball.first;
+            radii[lane] = ball.second;
+        }
+        sphere_packs.push_back(make_sphere_pack(centers, radii, 
+        sphere_ids + i, count));
+    }
+    return result;
+}
+
+size_t PackedLeaves::bytes() const
+{
+    return packs.size() * sizeof(TrianglePack) + 
+    mesh_packs.size() * sizeof(MeshPack) + 
+    sphere_packs.size() * sizeof(SpherePack);
+}
+
+void leaf_intersection(const PackedLeaves &packed, const LeafPacks &leaf, 
+const PrimStore &store, const unsigned int *ids, unsigned int num_prims, 
+const Ray &ray, Hit &result)
+{
+    float intersect;
+    float u;
+    float v;
+    for (unsigned int p = 0; p < leaf.num_packs; p++)
+    {
+        const TrianglePack &pack = packed.packs[leaf.offset + p];
+        int lane = pack_intersection(pack, ray, result.t, intersect, u, v);
+        if (lane >= 0)
+        {
+            result.t = intersect;
+            store.set_hit(result, pack.id[lane], u, v);
+        }
+    }
+    for (unsigned int p = 0; p < leaf.num_mesh_packs; p++)
+    {
+        const MeshPack &pack = packed.mesh_packs[leaf.mesh_offset + p];
+        int lane = mesh_pack_intersection(pack, *store.mesh, ray, result.t, 
+        intersect, u, v);
+        if (lane >= 0)
+        {
+            result.t = intersect;
+            store.set_hit(result, pack.id[lane], u, v);
+        }
+    }
+    for (unsigned int p = 0; p < leaf.num_sphere_packs; p++)
+    {
+        const SpherePack &pack = packed.sphere_packs[leaf.sphere_offset + p];
+        int lane = sphere_pack_intersection(pack, ray, result.t, intersect);
+        if (lane >= 0)
+        {
+            result.t = intersect;
+            store.set_hit(result, pack.id[lane], 0, 0);
+        }
+    }
+    for (unsigned int i = leaf.num_packed(); i < num_prims; i++)
+    {
+        u = 0;
+        v = 0;
+        intersect = store.intersection(ids[i], ray, u, v);
+        if (intersect < result.t)
+        {
+            result.t = intersect;
+            store.set_hit(result, ids[i], u, v);
+        }
+    }
+}
+
+bool leaf_occluded(const PackedLeaves &packed, const LeafPacks &leaf, 
+const PrimStore &store, const unsigned int *ids, unsigned int num_prims, 
+const Ray &ray, float max_dist)
+{
+    float intersect;
+    float u;
+    float v;
+    for (unsigned int p = 0; p < leaf.num_packs; p++)
+    {
+        if (pack_intersection(packed.packs[leaf.offset + p], ray, max_dist, 
+        intersect, u, v) >= 0)
+        {
+            return true;
+        }
+    }
+    for (unsigned int p = 0; p < leaf.num_mesh_packs; p++)
+    {
+        if (mesh_pack_intersection(packed.mesh_packs[leaf.mesh_offset + p], 
+        *store.mesh, ray, max_dist, intersect, u, v) >= 0)
+        {
+            return true;
+        }
+    }
+    for (unsigned int p = 0; p < leaf.num_sphere_packs; p++)
+    {
+        if (sphere_pack_intersection(packed.sphere_packs[leaf.sphere_offset + 
+        p], ray, max_dist, intersect) >= 0)
+        {
+            return true;
+        }
+    }
+    for (unsigned int i = leaf.num_packed(); i < num_prims; i++)
+    {
+        if (store.intersection(ids[i], ray) < max_dist)
+        {
+            return true;
+        }
+    }
+    return false;
+}
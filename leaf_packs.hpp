@@ -0,0 +1,61 @@
+#ifndef LEAF_PACKS_H
+#define LEAF_PACKS_H
+#include <vector>
+#include <cstddef>
+#include "vec3.hpp"
+#include "geometry.hpp"
+#include "tripack.hpp"
+#include "spherepack.hpp"
+#include "prim_store.hpp"
+
+// Primitives of a leaf as they sit in its part of the tree's reference 
+// array. Triangles of the scenery come first and are also stored in 
+// num_packs TrianglePacks starting at offset. Triangles of the mesh follow 
+// them, in MeshPacks from mesh_offset, then the spheres in SpherePacks from 
+// sphere_offset. Any other primitives come last and are tested one at a 
+// time.
+class LeafPacks
+{
+    public:
+        unsigned int offset;
+        unsigned int num_packs;
+        unsigned int num_tris;
+        unsigned int mesh_offset;
+        unsigned int num_mesh_packs;
+        unsigned int num_mesh_tris;
+        unsigned int sphere_offset;
+        unsigned int num_sphere_packs;
+        unsigned int num_spheres;
+        // Primitives before the ones tested one at a time
+        unsigned int num_packed() const
+        {
+            return num_tris + num_mesh_tris + num_spheres;
+        }
+};
+
+// Packs of every leaf of one tree
+class PackedLeaves
+{
+    public:
+        std::vector<TrianglePack> packs;
+        std::vector<MeshPack> mesh_packs;
+        std::vector<SpherePack> sphere_packs;
+        void clear();
+        // Orders the leaf's ids as LeafPacks describes and packs them
+        LeafPacks add(const PrimStore &store, unsigned int *ids, 
+        unsigned int num_prims);
+        size_t bytes() const;
+};
+
+// Tests of one leaf for trees that reference every primitive from a single 
+// leaf, so no ray meets a primitive twice and needs no mailbox. ids is the 
+// leaf's part of the tree's reference array. leaf_intersection() replaces 
+// result with any closer hit.
+void leaf_intersection(const PackedLeaves &packed, const LeafPacks &leaf, 
+const PrimStore &store, const unsigned int *ids, unsigned int num_prims, 
+const Ray &ray, Hit &result);
+
+bool leaf_occluded(const PackedLeaves &packed, const LeafPacks &leaf, 
+const PrimStore &store, const unsigned int *ids, unsigned int num_prims, 
+const Ray &ray, float max_dist);
+#endif
@@ -1,5 +1,8 @@
 #include "loader.hpp"
 #include "obj_loader.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
 
 int num_verts(std::string path)
 {
@@ -20,7 +23,7 @@ int num_verts(std::string path)
     return result;
 }
 
-void tri_ptr(std::string path, Triangle *t, color_info info)
+void tri_ptr(std::string path, Triangle *t, material_id info)
 {
     vec3 vertices[3];
     
@@ -46,37 +49,186 @@ void tri_ptr(std::string path, Triangle *t, color_info info)
                     curMesh.Vertices[j+k].Position.Z);
                 }
                 *(t + offset) = Triangle(vertices[0], vertices[1], vertices[2]);
-                (t + offset)->ka = info.ka;
-                (t + offset)->kd = info.kd;
-                (t + offset)->ks = info.ks;
-                (t + offset)->vis = info.vis;
-                (t + offset)->alpha = info.alpha;
-                (t + offset)->ior = info.ior;
+                (t + offset)->material = info;
                 offset += 1;
             }
         }
     }
 }
 
-void add(Triangle* t, std::vector<Shape*> &scenery, int size, vec3 pos, 
+// Centers the triangles of rest on their center of mass, scales them and 
+// moves them to pos, writing the result into t. Posing from an untouched 
+// copy each frame keeps animated objects from drifting. t may be rest.
+void place(Triangle *t, const Triangle *rest, int size, vec3 pos, 
 vec3 scaler)
 {
     vec3 com;
     for (int i = 0; i < size; i++)
     {
-        com += (t+i)->v0;
-        com += (t+i)->v1;
-        com += (t+i)->v2;
+        com += (rest+i)->v0;
+        com += (rest+i)->v1;
+        com += (rest+i)->v2;
     }
     com = (1.0 / (3 * size)) * com;
     
     for (int i = 0; i < size; i++)
     {
-        (t+i)->v0 = ((t+i)->v0 - com).comp_mul(scaler) + pos;
-        (t+i)->v1 = ((t+i)->v1 - com).comp_mul(scaler) + pos;
-        (t+i)->v2 = ((t+i)->v2 - com).comp_mul(scaler) + pos;
+        (t+i)->v0 = ((rest+i)->v0 - com).comp_mul(scaler) + pos;
+        (t+i)->v1 = ((rest+i)->v1 - com).comp_mul(scaler) + pos;
+        (t+i)->v2 = ((rest+i)->v2 - com).comp_mul(scaler) + pos;
         (t+i)->n = (((t+i)->v1 - (t+i)->v0).crossProduct((t+i)->v2 - (t+i)->v0))
         .normalize();
+        std::pair<vec3, vec3> bound = (t+i)->triangle_bounds();
+        (t+i)->minBounds = bound.first;
+        (t+i)->maxBounds = bound.second;
+    }
+}
+
+// Reads the v, vn and f lines of an .obj straight into a mesh, one line at 
+// a time. Faces keep the file's vertex numbers, so vertices shared in the 
+// file stay shared, and polygons are split into fans. The normals are kept 
+// only if every corner names one. Texture coordinates, groups and 
+// materials are skipped.
+TriMesh load_trimesh(std::string path, material_id info)
+{
+    TriMesh result;
+    result.material = info;
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Could not open " << path << std::endl;
+        return result;
+    }
+    std::string line;
+    std::vector<long> face;
+    std::vector<long> face_normals;
+    bool smooth = true;
+    while (std::getline(file, line))
+    {
+        const char *c = line.c_str();
+        char *end;
+        if (c[0] == 'v' && (c[1] == ' ' || c[1] == '\t' || (c[1] == 'n' && 
+        (c[2] == ' ' || c[2] == '\t'))))
+        {
+            bool is_normal = c[1] == 'n';
+            vec3 v;
+            c += is_normal ? 2 : 1;
+            for (int k = 0; k < 3; k++)
+            {
+                v.coord[k] = strtof(c, &end);
+                c = end;
+            }
+            (is_normal ? result.normals : result.vertices).push_back(v);
+        }
+        else if (c[0] == 'f' && (c[1] == ' ' || c[1] == '\t'))
+        {
+            face.clear();
+            face_normals.clear();
+            c++;
+            long index = strtol(c, &end, 10);
+            while (end != c)
+            {
+                // Negative numbers count back from the last vertex read
+                long num_vertices = result.vertices.size();
+                face.push_back(index < 0 ? num_vertices + index : index - 1);
+                if (face.back() < 0 || face.back() >= num_vertices)
+                {
+                    std::cerr << "Bad face in " << path << ": " << line << 
+                    std::endl;
+                    face.clear();
+                    break;
+                }
+                // Past the texture number to the normal number, if any
+                c = end;
+                long normal = 0;
+                if (*c == '/')
+                {
+                    strtol(c + 1, &end, 10);
+                    c = end;
+                    if (*c == '/')
+                    {
+                        normal = strtol(c + 1, &end, 10);
+                        c = end;
+                    }
+                }
+                long num_normals = result.normals.size();
+                face_normals.push_back(normal < 0 ? num_normals + normal : 
+                normal - 1);
+                if (face_normals.back() < 0 || 
+                face_normals.back() >= num_normals)
+                {
+                    smooth = false;
+                }
+                while (*c != '\0' && *c != ' ' && *c != '\t')
+                {
+                    c++;
+                }
+                index = strtol(c, &end, 10);
+            }
+            for (unsigned int i = 2; i < face.size(); i++)
+            {
+                result.indices.push_back(face[0]);
+                result.indices.push_back(face[i - 1]);
+                result.indices.push_back(face[i]);
+                if (smooth)
+                {
+                    result.normal_indices.push_back(face_normals[0]);
+                    result.normal_indices.push_back(face_normals[i - 1]);
+                    result.normal_indices.push_back(face_normals[i]);
+                }
+            }
+        }
+    }
+    if (!smooth)
+    {
+        std::vector<vec3>().swap(result.normals);
+        std::vector<unsigned int>().swap(result.normal_indices);
+    }
+    return result;
+}
+
+// place() for the vertices of a mesh. Corners are weighted by how many 
+// triangles use them, so the center matches the one of the triangles. A 
+// compressed mesh is quantized again at its new place.
+void place(TriMesh &mesh, const TriMesh &rest, vec3 pos, vec3 scaler)
+{
+    vec3 com;
+    for (unsigned int i = 0; i < rest.indices.size(); i++)
+    {
+        com += rest.position(rest.indices[i]);
+    }
+    if (!rest.indices.empty())
+    {
+        com = (1.0 / rest.indices.size()) * com;
+    }
+    bool compressed = mesh.compressed();
+    std::vector<vec3> moved(rest.num_vertices());
+    for (unsigned int i = 0; i < moved.size(); i++)
+    {
+        moved[i] = (rest.position(i) - com).comp_mul(scaler) + pos;
+    }
+    mesh.vertices.swap(moved);
+    // Normals scale by the inverse to stay perpendicular to the surface
+    vec3 inv_scaler = vec3(1 / scaler.coord[0], 1 / scaler.coord[1], 
+    1 / scaler.coord[2]);
+    mesh.normals.resize(rest.normals.size());
+    for (unsigned int i = 0; i < rest.normals.size(); i++)
+    {
+        mesh.normals[i] = rest.normals[i].comp_mul(inv_scaler).normalize();
+    }
+    mesh.normal_indices = rest.normal_indices;
+    if (compressed)
+    {
+        mesh.compress();
+    }
+}
+
+void add(Triangle* t, std::vector<Shape*> &scenery, int size, vec3 pos, 
+vec3 scaler)
+{
+    place(t, t, size, pos, scaler);
+    for (int i = 0; i < size; i++)
+    {
         scenery.push_back((t+i));
     }
 }
@@ -122,7 +274,7 @@ std::vector<vec3> extent(std::string path)
     result.push_back(com);
     result.push_back(min_coord);
     result.push_back(max_coord);
-    delete t;
+    delete[] t;
     return result;
 }
 
@@ -139,21 +291,21 @@ vec3 center_obj(std::string path, float mult)
 }
 
 void load_and_add(std::string path, Triangle *t, int num_tris, 
-std::vector<Shape*> &scenery, vec3 pos, vec3 scaler, color_info info)
+std::vector<Shape*> &scenery, vec3 pos, vec3 scaler, material_id info)
 {
     tri_ptr(path, t, info);
     add(t, scenery, num_tris, pos, scaler);
 }
 
-std::pair<vec3, vec3> scene_extent(const std::vector<Shape*> &scenery)
+std::pair<vec3, vec3> scene_extent(const PrimStore &store)
 {
     std::pair<vec3, vec3> result;
     
     vec3 min_coord = vec3(INFINITY, INFINITY, INFINITY);
     vec3 max_coord = vec3(-INFINITY, -INFINITY, -INFINITY);
-    for (unsigned int i = 0; i < scenery.size(); i++)
+    for (unsigned int i = 0; i < store.refs.size(); i++)
     {
-        std::pair<vec3, vec3> obj_bounds = (scenery[i])->bounds();
+        std::pair<vec3, vec3> obj_bounds = store.bounds(store.refs[i]);
         for (int j = 0; j < 3; j++)
         {
             if (obj_bounds.first.coord[j] < min_coord.coord[j])
@@ -3,11 +3,19 @@
 #include "geometry.hpp"
 #include "raytracer.hpp"
 #include "vec3.hpp"
+#include "prim_store.hpp"
 #include <string>
 #include <vector>
 int num_verts(std::string path);
 
-void tri_ptr(std::string path, Triangle *t, color_info info);
+void tri_ptr(std::string path, Triangle *t, material_id info);
+
+void place(Triangle *t, const Triangle *rest, int size, vec3 pos, 
+vec3 scaler);
+
+TriMesh load_trimesh(std::string path, material_id info);
+
+void place(TriMesh &mesh, const TriMesh &rest, vec3 pos, vec3 scaler);
 
 void add(Triangle* t, std::vector<Shape*> &scenery, int size, vec3 pos, 
 vec3 scaler);
@@ -16,7 +24,7 @@ std::vector<vec3> extent(std::string path);
 vec3 center_obj(std::string path, float mult);
 
 void load_and_add(std::string path, Triangle *t, int num_tris, 
-std::vector<Shape*> &scenery, vec3 pos, vec3 scaler, color_info info);
+std::vector<Shape*> &scenery, vec3 pos, vec3 scaler, material_id info);
 
-std::pair<vec3, vec3> scene_extent(const std::vector<Shape*> &scenery);
+std::pair<vec3, vec3> scene_extent(const PrimStore &store);
 #endif
@@ -4,45 +4,244 @@
 #include "drawer.hpp"
 #include "loader.hpp"
 #include "kdtree.hpp"
+#include "bvh.hpp"
+#include "bvh4.hpp"
+#include "tree_cache.hpp"
+#include "instance.hpp"
 #include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
 
-int main(void)
+int main(int argc, char **argv)
 {
+    // Options, --accel kdtree|bvh|bvh4, --split sah|midpoint for the kd 
+    // tree, --cache DIR to reuse kd trees built by earlier runs, 
+    // --instances N to place N copies of the .obj sharing one tree, 
+    // --frames N to render N frames of the objects bobbing up and down, 
+    // --spheres N to fill the room with N random spheres, 
+    // --vertices float|quantized to store the .obj at 16 bits per 
+    // coordinate, --size WxH for the resolution, --format float|half|byte 
+    // for the framebuffer's channels, --output png|ppm|pfm|hdr for the 
+    // image files, --aa N to supersample edges up to N x N rays per pixel 
+    // and, to render progressively instead, --budget SECONDS and or --noise 
+    // TARGET with at most --samples N rays per pixel
+    std::string accel_type = "kdtree";
+    split_type split_mode = SAH;
+    std::string cache_dir;
+    int num_instances = 0;
+    int num_frames = 1;
+    int num_spheres = 0;
+    bool quantize = false;
+    int width = 500;
+    int height = 500;
+    pixel_format format = FLOAT32;
+    std::string output_type = "png";
+    RenderBudget budget;
+    int aa_levels = 0;
+    for (int i = 1; i < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << flag << std::endl;
+            return 1;
+        }
+        std::string value = argv[i + 1];
+        int size_x;
+        int size_y;
+        if (flag == "--accel" && (value == "kdtree" || value == "bvh" || 
+        value == "bvh4"))
+        {
+            accel_type = value;
+        }
+        else if (flag == "--split" && (value == "sah" || value == "midpoint"))
+        {
+            split_mode = value == "sah" ? SAH : MIDPOINT;
+        }
+        else if (flag == "--cache")
+        {
+            cache_dir = value;
+        }
+        else if (flag == "--instances")
+        {
+            num_instances = atoi(value.c_str());
+        }
+        else if (flag == "--frames" && atoi(value.c_str()) > 0)
+        {
+            num_frames = atoi(value.c_str());
+        }
+        else if (flag == "--spheres")
+        {
+            num_spheres = atoi(value.c_str());
+        }
+        else if (flag == "--vertices" && (value == "float" || 
+        value == "quantized"))
+        {
+            quantize = value == "quantized";
+        }
+        else if (flag == "--size" && sscanf(value.c_str(), "%dx%d", &size_x, 
+        &size_y) == 2 && size_x > 0 && size_y > 0)
+        {
+            width = size_x;
+            height = size_y;
+        }
+        else if (flag == "--format" && (value == "float" || value == "half" || 
+        value == "byte"))
+        {
+            format = value == "float" ? FLOAT32 : 
+            value == "half" ? HALF : BYTE;
+        }
+        else if (flag == "--output" && (value == "png" || value == "ppm" || 
+        value == "pfm" || value == "hdr"))
+        {
+            output_type = value;
+        }
+        else if (flag == "--budget" && atof(value.c_str()) > 0)
+        {
+            budget.seconds = atof(value.c_str());
+        }
+        else if (flag == "--noise" && atof(value.c_str()) > 0)
+        {
+            budget.noise = atof(value.c_str());
+        }
+        else if (flag == "--samples" && atoi(value.c_str()) > 0)
+        {
+            budget.max_samples = atoi(value.c_str());
+        }
+        else if (flag == "--aa" && (value == "2" || value == "4" || 
+        value == "8" || value == "16"))
+        {
+            // Every level splits pixels in half along both sides
+            aa_levels = 0;
+            while ((2 << aa_levels) <= atoi(value.c_str()))
+            {
+                aa_levels++;
+            }
+        }
+        else
+        {
+            std::cerr << "Bad option " << flag << " " << value << std::endl;
+            return 1;
+        }
+    }
+    // A progressive render has no adaptive pass
+    if (aa_levels > 0 && budget.progressive())
+    {
+        std::cerr << "--aa can't be used with --budget or --noise" << 
+        std::endl;
+        return 1;
+    }
+
     // Vector containing primitives
     std::vector<Shape*> scenery;
+    int leaf_size = 10;
+    int tree_max_depth = 40;
 
-    // .obj files
+    // .obj files, either placed in the world next to the scenery or loaded 
+    // once as a mesh with its own tree that every instance shares
     std::string object_path = "dragon.obj";
     vec3 object_pos = vec3(0, 0, 0);
     vec3 object_scale(1, 1, 1);
-    int num_tris = num_verts(object_path) / 3;
-    Triangle *obj_ptr = new Triangle[num_tris];
-    load_and_add(object_path, obj_ptr, num_tris, scenery, object_pos, 
-    object_scale, GREEN);
+    std::shared_ptr<TriMesh> object;
+    TriMesh object_rest;
+    std::shared_ptr<Mesh> mesh;
+    if (num_instances > 0)
+    {
+        mesh = std::make_shared<Mesh>(object_path, GREEN, accel_type, 
+        leaf_size, quantize);
+    }
+    else
+    {
+        object = std::make_shared<TriMesh>(load_trimesh(object_path, GREEN));
+        if (num_frames > 1)
+        {
+            // Untouched copy to pose the object from every frame
+            object_rest = *object;
+        }
+        place(*object, *object, object_pos, object_scale);
+        if (quantize)
+        {
+            object->compress();
+        }
+    }
 
     // Spheres
     Sphere s(vec3(1, 0, -1), .1);
-    s.vis = REFLECTIVE;
+    s.material = MIRROR;
     //scenery.push_back(&s);
 
 
     // Room
     Triangle *room_ptr = new Triangle[12];
-    std::vector<color_info> info = {MIRROR, RED, GREEN, PURPLE, BLUE, BLACK};
+    std::vector<material_id> info = {MIRROR, RED, GREEN, PURPLE, BLUE, BLACK};
     vec3 room_extent = vec3(9.5, 9.5, 9.5);
     vec3 room_center = vec3();
     aa_room(room_center, room_extent, room_ptr, scenery, info);
 
+    // Sphere field, radii up to half the mean spacing of the centers
+    std::shared_ptr<SphereField> spheres;
+    if (num_spheres > 0)
+    {
+        spheres = std::make_shared<SphereField>();
+        spheres->material = BLUE;
+        vec3 room_size = 2 * room_extent;
+        float spacing = cbrt(room_size.coord[0] * room_size.coord[1] * 
+        room_size.coord[2] / num_spheres);
+        sphere_populator(room_center - room_extent, room_center + room_extent, 
+        num_spheres, .5 * spacing, *spheres);
+    }
+
     // Bounds
     vec3 minBounds = vec3(-10, -10, -10);
     vec3 maxBounds = -minBounds;
 
-    // kd tree
-    std::cout << "Creating kd tree" << std::endl;
-    int leaf_size = 10;
-    int tree_max_depth = 40;
-    kdtree t(minBounds, maxBounds, scenery, leaf_size, tree_max_depth);
-    std::cout << "Finished creating kd tree" << std::endl;
+    // Acceleration structure
+    std::cout << "Creating " << accel_type << std::endl;
+    auto build_start = std::chrono::steady_clock::now();
+    PrimStore store(scenery, object, spheres);
+    std::shared_ptr<Accel> t;
+    if (accel_type == "bvh")
+    {
+        t = std::make_shared<bvh>(store, leaf_size);
+    }
+    else if (accel_type == "bvh4")
+    {
+        t = std::make_shared<bvh4>(store, leaf_size);
+    }
+    else if (!cache_dir.empty())
+    {
+        t = cached_kdtree(minBounds, maxBounds, store, leaf_size, 
+        tree_max_depth, split_mode, cache_dir);
+    }
+    else
+    {
+        t = std::make_shared<kdtree>(minBounds, maxBounds, store, leaf_size, 
+        tree_max_depth, split_mode);
+    }
+    std::chrono::duration<float> build_time = 
+    std::chrono::steady_clock::now() - build_start;
+    std::cout << "Finished creating " << accel_type << " in " << 
+    build_time.count() << "s" << std::endl;
+    if (accel_type == "kdtree")
+    {
+        std::cout << tree_stats(*std::static_pointer_cast<kdtree>(t)) << 
+        std::endl;
+    }
+
+    // Top level over the room and the mesh instances
+    std::vector<Instance> instances;
+    std::shared_ptr<tlas> top;
+    if (num_instances > 0 && mesh->geometry->size() > 0)
+    {
+        instances = instance_grid(mesh, room_center - room_extent, 
+        room_center + room_extent, num_instances);
+        instances.push_back(Instance(t, Transform()));
+        top = std::make_shared<tlas>(instances);
+        t = top;
+        std::cout << "Placed " << num_instances << " instances of " << 
+        mesh->geometry->size() << " triangles" << std::endl;
+    }
     
     // Camera
     vec3 camera_pos = vec3(5, 0, -5);
@@ -53,13 +252,50 @@ int main(void)
     std::vector<Light> lights;
     lights.push_back(Light(vec3(0, 9, 0)));
 
-    // Rendering
-    auto rgb = new float [HEIGHT][WIDTH][3];
-    draw(t, lights, camera_pos, center, up, HEIGHT, WIDTH, IOR, 0, BIAS, FOV, 
-    "name", rgb);
-    std::cout << "Finished rendering" << std::endl;
-    delete rgb;
-    delete obj_ptr;
-    delete room_ptr;
+    // Rendering, between frames BVHs are refitted to the moved objects and 
+    // kd-trees re-split the subtrees those objects left or entered. Either 
+    // is rebuilt once its SAH cost grows too far past the last build.
+    Framebuffer image(width, height, format);
+    for (int frame = 0; frame < num_frames; frame++)
+    {
+        std::string filename = "name";
+        if (num_frames > 1)
+        {
+            filename += "_" + std::to_string(frame);
+        }
+        filename += "." + output_type;
+        if (frame > 0)
+        {
+            auto update_start = std::chrono::steady_clock::now();
+            float phase = 2 * M_PI * frame / num_frames;
+            if (top)
+            {
+                for (int i = 0; i < num_instances; i++)
+                {
+                    Transform moved = instances[i].to_world;
+                    moved.m[1][3] += sin(phase + i);
+                    top->set_transform(i, moved);
+                }
+            }
+            else
+            {
+                place(*object, object_rest, 
+                object_pos + vec3(0, sin(phase), 0), object_scale);
+            }
+            t->update();
+            std::chrono::duration<float> update_time = 
+            std::chrono::steady_clock::now() - update_start;
+            std::cout << "Updated " << accel_type << " in " << 
+            update_time.count() << "s" << std::endl;
+        }
+        draw(*t, lights, camera_pos, center, up, IOR, 0, BIAS, FOV, filename, 
+        image, budget, aa_levels);
+        std::cout << "Finished rendering " << filename << std::endl;
+    }
+    if (accel_type == "kdtree")
+    {
+        std::cout << traversal_stats() << std::endl;
+    }
+    delete[] room_ptr;
     return 0;
 }
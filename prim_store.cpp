@@ -0,0 +1,53 @@
+#include "prim_store.hpp"
+
+PrimStore::PrimStore(const std::vector<Shape*> &scenery, 
+std::shared_ptr<const TriMesh> mesh, std::shared_ptr<const SphereField> field)
+{
+    sources = scenery;
+    this->mesh = mesh;
+    this->field = field;
+    unsigned int num_mesh = mesh ? mesh->size() : 0;
+    unsigned int num_field = field ? field->size() : 0;
+    refs.reserve(scenery.size() + num_mesh + num_field);
+    for (unsigned int i = 0; i < scenery.size(); i++)
+    {
+        if (scenery[i]->type == TRIANGLE)
+        {
+            refs.push_back(prim_ref(TRIANGLE, triangles.size()));
+            triangle_ids.push_back(i);
+            triangles.push_back(TriangleVerts());
+        }
+        else
+        {
+            refs.push_back(prim_ref(SPHERE, spheres.size()));
+            sphere_ids.push_back(i);
+            spheres.push_back(Sphere());
+        }
+    }
+    for (unsigned int i = 0; i < num_mesh; i++)
+    {
+        refs.push_back(prim_ref(MESH_TRIANGLE, i));
+    }
+    for (unsigned int i = 0; i < num_field; i++)
+    {
+        refs.push_back(prim_ref(FIELD_SPHERE, i));
+    }
+    sync();
+}
+
+// Copies the geometry of the sources again, after they moved. The mesh and 
+// the field are read in place and need nothing.
+void PrimStore::sync()
+{
+    for (unsigned int i = 0; i < triangles.size(); i++)
+    {
+        const Triangle *t = static_cast<Triangle*>(sources[triangle_ids[i]]);
+        triangles[i].v0 = t->v0;
+        triangles[i].v1 = t->v1;
+        triangles[i].v2 = t->v2;
+    }
+    for (unsigned int i = 0; i < spheres.size(); i++)
+    {
+        spheres[i] = *static_cast<Sphere*>(sources[sphere_ids[i]]);
+    }
+}
@@ -0,0 +1,195 @@
+#ifndef PRIM_STORE_H
+#define PRIM_STORE_H
+#include <vector>
+#include <memory>
+#include "vec3.hpp"
+#include "geometry.hpp"
+#include "accel.hpp"
+// A reference keeps the shape type above this bit and the index into 
+// that type's array below it
+#define PRIM_TYPE_SHIFT 30
+#define PRIM_INDEX_MASK ((1u << PRIM_TYPE_SHIFT) - 1)
+
+inline unsigned int prim_ref(shape_type type, unsigned int index)
+{
+    return ((unsigned int) type << PRIM_TYPE_SHIFT) | index;
+}
+
+inline shape_type ref_type(unsigned int ref)
+{
+    return (shape_type) (ref >> PRIM_TYPE_SHIFT);
+}
+
+inline unsigned int ref_index(unsigned int ref)
+{
+    return ref & PRIM_INDEX_MASK;
+}
+
+// Scene primitives grouped by type, so trees hold references instead of 
+// Shape pointers and call the kernels directly rather than through the 
+// vtable. Triangles keep only their corners, the source shapes still 
+// provide materials and normals for shading. Triangles of the mesh and 
+// spheres of the field are read straight from their shared buffers and 
+// are never copied.
+class PrimStore
+{
+    public:
+        std::vector<TriangleVerts> triangles;
+        std::vector<Sphere> spheres;
+        std::shared_ptr<const TriMesh> mesh;
+        std::shared_ptr<const SphereField> field;
+        // Input index of each entry of triangles and spheres
+        std::vector<unsigned int> triangle_ids;
+        std::vector<unsigned int> sphere_ids;
+        // Reference of every input primitive, in input order. The shapes 
+        // come first, then the triangles of the mesh and the spheres of 
+        // the field.
+        std::vector<unsigned int> refs;
+        // The shapes copied from, read again by sync()
+        std::vector<Shape*> sources;
+        PrimStore()
+        {
+        }
+        PrimStore(const std::vector<Shape*> &scenery, 
+        std::shared_ptr<const TriMesh> mesh = NULL, 
+        std::shared_ptr<const SphereField> field = NULL);
+        void sync();
+        // Index of ref in refs
+        unsigned int position(unsigned int ref) const
+        {
+            unsigned int i = ref_index(ref);
+            switch (ref_type(ref))
+            {
+                case TRIANGLE:
+                    return triangle_ids[i];
+                case SPHERE:
+                    return sphere_ids[i];
+                case MESH_TRIANGLE:
+                    return sources.size() + i;
+                default:
+                    return sources.size() + (mesh ? mesh->size() : 0) + i;
+            }
+        }
+        static bool is_sphere(unsigned int ref)
+        {
+            return ref_type(ref) == SPHERE || ref_type(ref) == FIELD_SPHERE;
+        }
+        TriangleVerts corners(unsigned int ref) const
+        {
+            if (ref_type(ref) == TRIANGLE)
+            {
+                return triangles[ref_index(ref)];
+            }
+            unsigned int i = ref_index(ref);
+            return TriangleVerts{mesh->vertex(i, 0), mesh->vertex(i, 1), 
+            mesh->vertex(i, 2)};
+        }
+        // Center and radius of a sphere
+        std::pair<vec3, float> ball(unsigned int ref) const
+        {
+            unsigned int i = ref_index(ref);
+            if (ref_type(ref) == SPHERE)
+            {
+                return std::make_pair(spheres[i].pos, spheres[i].radius);
+            }
+            return std::make_pair(field->center(i), field->radius[i]);
+        }
+        // u and v are left alone for spheres
+        float intersection(unsigned int ref, const Ray &ray, float &u, 
+        float &v) const
+        {
+            unsigned int i = ref_index(ref);
+            switch (ref_type(ref))
+            {
+                case TRIANGLE:
+                    return triangle_intersection(triangles[i].v0, 
+                    triangles[i].v1, triangles[i].v2, ray, u, v);
+                case MESH_TRIANGLE:
+                    return triangle_intersection(mesh->vertex(i, 0), 
+                    mesh->vertex(i, 1), mesh->vertex(i, 2), ray, u, v);
+                case FIELD_SPHERE:
+                    return sphere_intersection(field->center(i), 
+                    field->radius[i], ray);
+                default:
+                    return spheres[i].Sphere::intersection(ray);
+            }
+        }
+        float intersection(unsigned int ref, const Ray &ray) const
+        {
+            float u;
+            float v;
+            return intersection(ref, ray, u, v);
+        }
+        // NULL for primitives of the mesh and the field
+        const Shape *shape(unsigned int ref) const
+        {
+            switch (ref_type(ref))
+            {
+                case TRIANGLE:
+                    return sources[triangle_ids[ref_index(ref)]];
+                case SPHERE:
+                    return sources[sphere_ids[ref_index(ref)]];
+                default:
+                    return NULL;
+            }
+        }
+        void set_hit(Hit &hit, unsigned int ref, float u, float v) const
+        {
+            hit.u = u;
+            hit.v = v;
+            hit.store = this;
+            hit.prim = ref;
+        }
+        material_id material(unsigned int ref) const
+        {
+            switch (ref_type(ref))
+            {
+                case MESH_TRIANGLE:
+                    return mesh->material;
+                case FIELD_SPHERE:
+                    return field->material;
+                default:
+                    return shape(ref)->material;
+            }
+        }
+        // Shading normal at point, u and v from the hit
+        vec3 normal(unsigned int ref, vec3 point, float u, float v) const
+        {
+            unsigned int i = ref_index(ref);
+            switch (ref_type(ref))
+            {
+                case MESH_TRIANGLE:
+                    return mesh->shading_normal(i, u, v);
+                case FIELD_SPHERE:
+                    return (1 / field->radius[i]) * (point - field->center(i));
+                default:
+                    return shape(ref)->normal(point);
+            }
+        }
+        std::pair<vec3, vec3> bounds(unsigned int ref) const
+        {
+            switch (ref_type(ref))
+            {
+                case MESH_TRIANGLE:
+                    return mesh->bounds(ref_index(ref));
+                case FIELD_SPHERE:
+                    return field->bounds(ref_index(ref));
+                default:
+                    return std::make_pair(shape(ref)->minBounds, 
+                    shape(ref)->maxBounds);
+            }
+        }
+        bool inBounds(unsigned int ref, vec3 min, vec3 max) const
+        {
+            switch (ref_type(ref))
+            {
+                case MESH_TRIANGLE:
+                    return mesh->inBounds(ref_index(ref), min, max);
+                case FIELD_SPHERE:
+                    return field->inBounds(ref_index(ref), min, max);
+                default:
+                    return shape(ref)->inBounds(min, max);
+            }
+        }
+};
+#endif
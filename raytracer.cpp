@@ -1,46 +1,75 @@
 #include "geometry.hpp"
 #include "vec3.hpp"
+#include "vec4.hpp"
 #include "raytracer.hpp"
+#include "instance.hpp"
 #include <algorithm>
 
-bool inShadow(vec3 point, const kdtree &t, Light l)
+bool inShadow(vec3 point, const Accel &t, Light l)
 {
-    vec3 dir = (l.pos - point).normalize();
-    std::pair<float, Shape*> result = closestIntersect(point, dir, t);
-    return result.first < (l.pos - point).norm();
+    vec3 to_light = l.pos - point;
+    float dist = to_light.norm();
+    return t.occluded(point, (1.0 / dist) * to_light, dist);
+}
+
+const color_info& hit_material(const Hit &hit)
+{
+    return materials[hit.store->material(hit.prim)];
+}
+
+vec3 object_normal(const Hit &hit, vec3 point)
+{
+    return hit.store->normal(hit.prim, point, hit.u, hit.v);
+}
+
+// Shapes inside an instance work in object space, so the point goes in and 
+// the normal comes out through the instance transform
+vec3 surface_normal(const Hit &hit, vec3 point)
+{
+    if (hit.instance == NULL)
+    {
+        return object_normal(hit, point);
+    }
+    vec3 object_point = hit.instance->to_object.point(point);
+    return hit.instance->normal_to_world(object_normal(hit, object_point));
 }
 
 // Phong illumination model
-vec3 lighting(vec3 origin, vec3 direction, std::pair<float, Shape*> hit, 
-const kdtree &t, const std::vector<Light> &lights, int depth)
+vec3 lighting(vec3 origin, vec3 direction, Hit hit, 
+const Accel &t, const std::vector<Light> &lights, int depth)
 {
     vec3 result = vec3();
-    vec3 hitPoint = origin + hit.first * direction;
-    vis_type lighting_type = hit.second->vis;
-    vec3 n = hit.second->normal(hitPoint);
+    vec3 hitPoint = origin + hit.t * direction;
+    const color_info &mat = hit_material(hit);
+    vis_type lighting_type = mat.vis;
+    vec3 n = surface_normal(hit, hitPoint);
 
     if (lighting_type == OPAQUE)
     {
+        vec4 point = vec4(hitPoint);
+        vec4 normal = vec4(n);
+        vec4 to_v = -vec4(direction);
+        vec4 ka = vec4(mat.ka);
+        vec4 kd = vec4(mat.kd);
+        vec4 ks = vec4(mat.ks);
+        vec4 sum;
         for (unsigned int i = 0; i < lights.size(); i++)
         {
-            Light light_i = lights[i];
-            vec3 ka = hit.second->ka;
-            result += ka.comp_mul(light_i.ia);
+            const Light &light_i = lights[i];
+            sum += ka.comp_mul(vec4(light_i.ia));
             bool shadow_test = !inShadow(hitPoint + BIAS * n, t, light_i);
 
             if (shadow_test)
             {
-                vec3 kd = (hit.second)->kd;
-                vec3 ks = (hit.second)->ks;
-                float alpha = (hit.second)->alpha;
-                vec3 to_l = (light_i.pos - hitPoint).normalize();
-                vec3 to_v = -direction;
-                vec3 r = (-to_l).reflect(n);
+                float alpha = mat.alpha;
+                vec4 to_l = (vec4(light_i.pos) - point).normalize();
+                vec4 r = (-to_l).reflect(normal);
 
-                result += fmax(0, n * to_l) * kd.comp_mul(light_i.id) + 
-                pow(fmax(0, r * to_v), alpha) * ks.comp_mul(light_i.is);
+                sum += fmax(0, normal * to_l) * kd.comp_mul(vec4(light_i.id)) + 
+                pow(fmax(0, r * to_v), alpha) * ks.comp_mul(vec4(light_i.is));
             }
         }
+        result = sum.xyz();
     }
     else if (lighting_type == REFLECTIVE)
     {
@@ -50,11 +79,11 @@ const kdtree &t, const std::vector<Light> &lights, int depth)
     else
     {
         float ior1 = IOR;
-        float ior2 = hit.second->ior;
+        float ior2 = mat.ior;
         // Swap indices of refraction if ray is leaving object
         if (direction * n > 0)
         {
-            ior1 = hit.second->ior;
+            ior1 = mat.ior;
             ior2 = IOR;
             n = -n;
         }
@@ -78,140 +107,36 @@ const kdtree &t, const std::vector<Light> &lights, int depth)
     return result.clamp();
 }
 
-// Returns point on screen that ray emitted at the origin to pixel (row, col)
-// would intersect with
-vec3 primary(int row, int col, float fov)
+// Returns point on screen that ray emitted at the origin to the image point 
+// (y, x) would intersect with. y and x count pixels from the top left 
+// corner, the center of pixel (row, col) is at (row + .5, col + .5). fov is 
+// vertical, wide images see more to the sides.
+vec3 primary(float y, float x, int width, int height, float fov)
 {
-    float ratio = WIDTH / HEIGHT;
-    float py = (1 - 2 * ((row + .5) / HEIGHT)) * tan(fov / 2.0 * M_PI / 180);
-    float px = (2 * ((col + .5) / WIDTH) - 1) * tan(fov / 2.0 * M_PI / 180) *
+    float ratio = float(width) / height;
+    float py = (1 - 2 * (double(y) / height)) * tan(fov / 2.0 * M_PI / 180);
+    float px = (2 * (double(x) / width) - 1) * tan(fov / 2.0 * M_PI / 180) * 
     ratio;
     vec3 primary = vec3(px, py, -1);
     return primary;
 }
 
-std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>> order(vec3 dir, 
-int axis, std::shared_ptr<Node> n)
-{
-    std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>> result;
-    if (dir.coord[axis] > 0)
-    {
-        result.first = n->left;
-        result.second = n->right;
-    }
-    else
-    {
-        result.first = n->right;
-        result.second = n->left;
-    }
-    return result;
-}
-
-std::pair<float, Shape*> searchNode(std::shared_ptr<Node> n, vec3 origin, 
-vec3 direction, float t_min, float t_max, std::vector<NodeStack> &s)
-{
-    std::pair<float, Shape*> result;
-    result.first = INFINITY;
-    result.second = NULL;
-    if (n->isLeaf)
-    {
-        for (unsigned int i = 0; i < (n->primitives).size(); i++)
-        {
-            float intersect = ((n->primitives)[i])->
-            intersection(origin, direction);
-            if (intersect < result.first)
-            {
-                result.first = intersect;
-                result.second = (n->primitives)[i];
-            }
-        }
-        if (result.first < t_max)
-        {
-            return result;
-        }
-        else if (s.empty())
-        {
-            result.first = INFINITY;
-            result.second = NULL;
-            return result;
-        }
-        else
-        {
-            NodeStack popped = s.back();
-            s.pop_back();
-            return searchNode(popped.n, origin, direction, popped.t_min, 
-            popped.t_max, s);
-        }
-
-    }
-    else
-    {
-        // Coordinate of split is on the split_axis dimension and equal to 
-        // the maxBounds of the left node or minBound of right node
-        float split_val = ((n->left)->maxBounds).coord[n->split_axis];
-        float inverse_coord = 1.0 / direction.coord[n->split_axis];
-        float t_hit = (split_val - origin.coord[n->split_axis]) * inverse_coord;
-
-        std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>> ordered = 
-        order(direction, n->split_axis, n);
-
-        if (t_hit < t_min)
-        {
-
-            return searchNode(ordered.second, origin, direction, t_min, t_max, 
-            s);
-        }
-        else if (t_hit > t_max)
-        {
-            return searchNode(ordered.first, origin, direction, t_min, t_max, 
-            s);
-        }
-        else
-        {
-            NodeStack pushed;
-            pushed.n = ordered.second;
-            pushed.t_min = t_hit;
-            pushed.t_max = t_max;
-            s.push_back(pushed);
-            return searchNode(ordered.first, origin, direction, t_min, t_hit, 
-            s);
-        }
-    }
-}
-
-std::pair<float, Shape*> closestIntersect(vec3 origin, vec3 direction, 
-const kdtree &t)
-{
-    std::pair<float, float> t_bounds = 
-    aabb_intersection((t.root)->minBounds, (t.root)->maxBounds,
-    origin, direction);
-    std::vector<NodeStack> s;
-    std::pair<float, Shape*> result;
-    if (std::isinf(t_bounds.first))
-    {
-        result.first = INFINITY;
-    }
-    else
-    {
-        result = searchNode(t.root, origin, direction, t_bounds.first, 
-        t_bounds.second, s);
-    }
-    s.clear();
-    return result;
-}
-
-
 // Returns the rgb data a observer at vec3 origin would see when looking in 
-// the direction of vec3 direction
-vec3 caster(vec3 origin, vec3 direction, const kdtree &t, 
-const std::vector<Light> &lights, int depth)
+// the direction of vec3 direction. The first hit along it goes to first if 
+// that is set.
+vec3 caster(vec3 origin, vec3 direction, const Accel &t, 
+const std::vector<Light> &lights, int depth, Hit *first)
 {
     if (depth > MAX_DEPTH)
     {
         return BG_COLOR;
     }
-    std::pair<float, Shape*> hit = closestIntersect(origin, direction, t);
-    if (hit.first < INFINITY)
+    Hit hit = t.intersect(origin, direction);
+    if (first)
+    {
+        *first = hit;
+    }
+    if (hit.t < INFINITY)
     {
         vec3 lighting_val = lighting(origin, direction, hit, t, lights, depth);
         return lighting_val;
@@ -259,22 +184,24 @@ float* lookAtMatrix(vec3 eye, vec3 center, vec3 up)
     return mat;    
 }
 
+// v is a point, its fourth coordinate is 1
 vec3 lookAt(float *mat, vec3 v)
 {
     vec3 result;
 
     for (int i = 0; i < 3; i++)
     {
-        for (int j = 0; j < 4; j++)
+        for (int j = 0; j < 3; j++)
         {
             result.coord[i] +=  *(index(mat, i, j)) * v.coord[j];
         }
+        result.coord[i] += *(index(mat, i, 3));
     }
     return result;
 }
 
 void sphere_populator(vec3 minBounds, vec3 maxBounds, int num_sphere, 
-float max_rad, Sphere *s, std::vector<Shape*> &scenery)
+float max_rad, SphereField &field)
 {
     for (int i = 0; i < num_sphere; i++)
     {
@@ -285,12 +212,12 @@ float max_rad, Sphere *s, std::vector<Shape*> &scenery)
         ((float) rand() / RAND_MAX) + minBounds.coord[1];
         float rand_z = (maxBounds.coord[2] - minBounds.coord[2]) * 
         ((float) rand() / RAND_MAX) + minBounds.coord[2];
-        *(s+i) = Sphere(vec3(rand_x, rand_y, rand_z), rand_r);
-        scenery.push_back((s+i));
+        field.add(vec3(rand_x, rand_y, rand_z), rand_r);
     }
 }
 
-std::vector<Triangle> panel_placer(vec3 center, vec3 extent, color_info info)
+std::vector<Triangle> panel_placer(vec3 center, vec3 extent, 
+material_id info)
 {
     vec3 top_right = center;
     vec3 bottom_left = center;
@@ -313,18 +240,8 @@ std::vector<Triangle> panel_placer(vec3 center, vec3 extent, color_info info)
     corner2.coord[used[1]] = center.coord[used[1]] - extent.coord[used[1]];
     Triangle t1 = Triangle(bottom_left, top_right, corner1, normal);
     Triangle t2 = Triangle(bottom_left, top_right, corner2, normal);
-    t1.ka = info.ka;
-    t1.kd = info.kd;
-    t1.ks = info.ks;
-    t1.vis = info.vis;
-    t1.alpha = info.alpha;
-    t1.ior = info.ior;
-    t2.ka = info.ka;
-    t2.kd = info.kd;
-    t2.ks = info.ks;
-    t2.vis = info.vis;
-    t2.alpha = info.alpha;
-    t2.ior = info.ior;
+    t1.material = info;
+    t2.material = info;
     result.push_back(t1);
     result.push_back(t2);
     return result;
@@ -333,7 +250,7 @@ std::vector<Triangle> panel_placer(vec3 center, vec3 extent, color_info info)
 
 // Room colors go as +x -x +y -y +z -z
 void aa_room(vec3 center, vec3 extent, Triangle *t, 
-std::vector<Shape*> &scenery, std::vector<color_info> info)
+std::vector<Shape*> &scenery, std::vector<material_id> info)
 {
     vec3 extent_x = extent;
     vec3 extent_y = extent;
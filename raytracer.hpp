@@ -1,45 +1,31 @@
 #ifndef RAYTRACER_H
 #define RAYTRACER_H
 #define IOR 1.0
-#define WIDTH 500
-#define HEIGHT 500
 #define MAX_DEPTH 9
 #define BIAS .01
 #define FOV 50
 #include "vec3.hpp"
 #include "geometry.hpp"
-#include "kdtree.hpp"
+#include "accel.hpp"
 #include <memory>
 
-class NodeStack
-{
-    public:
-        std::shared_ptr<Node> n;
-        float t_min;
-        float t_max;
-};
-
 const vec3 BG_COLOR = vec3(.2, .2, .2);
 
-bool inShadow(vec3 point, const kdtree &t, Light l);
-
-vec3 lighting(vec3 origin, vec3 direction, std::pair<float, Shape*> hit, 
-const kdtree &t, const std::vector<Light> &lights, int depth);
+bool inShadow(vec3 point, const Accel &t, Light l);
 
-vec3 primary(int row, int col, float fov);
+const color_info& hit_material(const Hit &hit);
 
-std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>> order(vec3 dir, 
-int axis, std::shared_ptr<Node> n);
+vec3 object_normal(const Hit &hit, vec3 point);
 
-std::pair<float, Shape*> searchNode(std::shared_ptr<Node> n, vec3 origin, 
-vec3 direction, float t_min, float t_max, std::vector<NodeStack> &s);
+vec3 surface_normal(const Hit &hit, vec3 point);
 
-std::pair<float, Shape*> closestIntersect(vec3 origin, vec3 direction, 
-const kdtree &t);
+vec3 lighting(vec3 origin, vec3 direction, Hit hit, 
+const Accel &t, const std::vector<Light> &lights, int depth);
 
-vec3 caster(vec3 origin, vec3 direction, const kdtree &t, 
+vec3 primary(float y, float x, int width, int height, float fov);
 
-const std::vector<Light> &lights, int depth);
+vec3 caster(vec3 origin, vec3 direction, const Accel &t, 
+const std::vector<Light> &lights, int depth, Hit *first = NULL);
 
 float* index(float *p, int i, int j);
 
@@ -48,10 +34,11 @@ float* lookAtMatrix(vec3 eye, vec3 center, vec3 up);
 vec3 lookAt(float *mat, vec3 v);
 
 void sphere_populator(vec3 minBounds, vec3 maxBounds, int num_sphere, 
-float max_rad, Sphere *s, std::vector<Shape*> &scenery);
+float max_rad, SphereField &field);
 
-std::vector<Triangle> panel_placer(vec3 center, vec3 extent, color_info info);
+std::vector<Triangle> panel_placer(vec3 center, vec3 extent, 
+material_id info);
 
 void aa_room(vec3 center, vec3 extent, Triangle *t, 
-std::vector<Shape*> &scenery, std::vector<color_info> info);
+std::vector<Shape*> &scenery, std::vector<material_id> info);
 #endif
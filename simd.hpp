@@ -0,0 +1,265 @@
+#ifndef SIMD_H
+#define SIMD_H
+#include <algorithm>
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Four float lanes. Uses SSE where available and plain arrays elsewhere, so 
+// kernels written against it still build on other targets. Comparisons 
+// return lane masks that movemask() turns into one bit per lane.
+#ifdef __SSE2__
+class float4
+{
+    public:
+        __m128 v;
+        float4()
+        {
+        }
+        float4(__m128 v)
+        {
+            this->v = v;
+        }
+        explicit float4(float x)
+        {
+            v = _mm_set1_ps(x);
+        }
+        static float4 load(const float *p)
+        {
+            return float4(_mm_loadu_ps(p));
+        }
+        void store(float *p) const
+        {
+            _mm_storeu_ps(p, v);
+        }
+};
+
+inline float4 operator+(float4 left, float4 right)
+{
+    return _mm_add_ps(left.v, right.v);
+}
+
+inline float4 operator-(float4 left, float4 right)
+{
+    return _mm_sub_ps(left.v, right.v);
+}
+
+inline float4 operator*(float4 left, float4 right)
+{
+    return _mm_mul_ps(left.v, right.v);
+}
+
+inline float4 operator/(float4 left, float4 right)
+{
+    return _mm_div_ps(left.v, right.v);
+}
+
+inline float4 min4(float4 left, float4 right)
+{
+    return _mm_min_ps(left.v, right.v);
+}
+
+inline float4 max4(float4 left, float4 right)
+{
+    return _mm_max_ps(left.v, right.v);
+}
+
+inline float4 sqrt4(float4 x)
+{
+    return _mm_sqrt_ps(x.v);
+}
+
+// Estimate refined by one Newton step, good to about 22 bits
+inline float4 rsqrt4(float4 x)
+{
+    __m128 y = _mm_rsqrt_ps(x.v);
+    __m128 half_xyy = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(.5f), x.v), 
+    _mm_mul_ps(y, y));
+    return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), half_xyy));
+}
+
+// Smallest and largest of the first three lanes, nested like 
+// std::min(std::min(x, y), z) so NaN lanes are passed over the same way
+inline float hmin3(float4 x)
+{
+    __m128 y = _mm_shuffle_ps(x.v, x.v, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(x.v, x.v, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_min_ss(z, _mm_min_ss(y, x.v)));
+}
+
+inline float hmax3(float4 x)
+{
+    __m128 y = _mm_shuffle_ps(x.v, x.v, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(x.v, x.v, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_max_ss(z, _mm_max_ss(y, x.v)));
+}
+
+inline float4 operator<(float4 left, float4 right)
+{
+    return _mm_cmplt_ps(left.v, right.v);
+}
+
+inline float4 operator<=(float4 left, float4 right)
+{
+    return _mm_cmple_ps(left.v, right.v);
+}
+
+inline float4 operator>(float4 left, float4 right)
+{
+    return _mm_cmpgt_ps(left.v, right.v);
+}
+
+inline float4 operator>=(float4 left, float4 right)
+{
+    return _mm_cmpge_ps(left.v, right.v);
+}
+
+inline float4 operator==(float4 left, float4 right)
+{
+    return _mm_cmpeq_ps(left.v, right.v);
+}
+
+inline float4 operator!=(float4 left, float4 right)
+{
+    return _mm_cmpneq_ps(left.v, right.v);
+}
+
+inline float4 operator&(float4 left, float4 right)
+{
+    return _mm_and_ps(left.v, right.v);
+}
+
+inline float4 operator|(float4 left, float4 right)
+{
+    return _mm_or_ps(left.v, right.v);
+}
+
+// Lanes set in the mask right but clear in mask
+inline float4 andnot(float4 mask, float4 right)
+{
+    return _mm_andnot_ps(mask.v, right.v);
+}
+
+// Lanes of left where mask is set, of right elsewhere
+inline float4 select(float4 mask, float4 left, float4 right)
+{
+    return _mm_or_ps(_mm_and_ps(mask.v, left.v), 
+    _mm_andnot_ps(mask.v, right.v));
+}
+
+inline int movemask(float4 mask)
+{
+    return _mm_movemask_ps(mask.v);
+}
+#else
+class float4
+{
+    public:
+        float v[4];
+        float4()
+        {
+        }
+        explicit float4(float x)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                v[i] = x;
+            }
+        }
+        static float4 load(const float *p)
+        {
+            float4 result;
+            std::copy(p, p + 4, result.v);
+            return result;
+        }
+        void store(float *p) const
+        {
+            std::copy(v, v + 4, p);
+        }
+};
+
+// Masks are stored as 1 or 0 per lane
+#define FLOAT4_OP(name, expr) \
+inline float4 name(float4 left, float4 right) \
+{ \
+    float4 result; \
+    for (int i = 0; i < 4; i++) \
+    { \
+        float l = left.v[i]; \
+        float r = right.v[i]; \
+        result.v[i] = expr; \
+    } \
+    return result; \
+}
+
+FLOAT4_OP(operator+, l + r)
+FLOAT4_OP(operator-, l - r)
+FLOAT4_OP(operator*, l * r)
+FLOAT4_OP(operator/, l / r)
+FLOAT4_OP(min4, l < r ? l : r)
+FLOAT4_OP(max4, l > r ? l : r)
+FLOAT4_OP(operator<, l < r)
+FLOAT4_OP(operator<=, l <= r)
+FLOAT4_OP(operator>, l > r)
+FLOAT4_OP(operator>=, l >= r)
+FLOAT4_OP(operator==, l == r)
+FLOAT4_OP(operator!=, l != r)
+FLOAT4_OP(operator&, l != 0 && r != 0)
+FLOAT4_OP(operator|, l != 0 || r != 0)
+FLOAT4_OP(andnot, l == 0 && r != 0)
+#undef FLOAT4_OP
+
+inline float4 sqrt4(float4 x)
+{
+    float4 result;
+    for (int i = 0; i < 4; i++)
+    {
+        result.v[i] = std::sqrt(x.v[i]);
+    }
+    return result;
+}
+
+inline float4 rsqrt4(float4 x)
+{
+    float4 result;
+    for (int i = 0; i < 4; i++)
+    {
+        result.v[i] = 1 / std::sqrt(x.v[i]);
+    }
+    return result;
+}
+
+inline float hmin3(float4 x)
+{
+    float m = x.v[1] < x.v[0] ? x.v[1] : x.v[0];
+    return x.v[2] < m ? x.v[2] : m;
+}
+
+inline float hmax3(float4 x)
+{
+    float m = x.v[1] > x.v[0] ? x.v[1] : x.v[0];
+    return x.v[2] > m ? x.v[2] : m;
+}
+
+inline float4 select(float4 mask, float4 left, float4 right)
+{
+    float4 result;
+    for (int i = 0; i < 4; i++)
+    {
+        result.v[i] = mask.v[i] != 0 ? left.v[i] : right.v[i];
+    }
+    return result;
+}
+
+inline int movemask(float4 mask)
+{
+    int result = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        result |= (mask.v[i] != 0) << i;
+    }
+    return result;
+}
+#endif
+#endif
@@ -0,0 +1,65 @@
+#include "spherepack.hpp"
+#include "simd.hpp"
+#include <cmath>
+
+// Fills the first count lanes with the spheres, ids are the primitive ids 
+// reported back for them
+SpherePack make_sphere_pack(const vec3 *centers, const float *radii, 
+const unsigned int *ids, int count)
+{
+    SpherePack result;
+    for (int lane = 0; lane < PACK_WIDTH; lane++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            result.center[k][lane] = lane < count ? centers[lane].coord[k] : 
+            NAN;
+        }
+        result.radius[lane] = lane < count ? radii[lane] : NAN;
+        result.id[lane] = lane < count ? ids[lane] : PACK_EMPTY;
+    }
+    return result;
+}
+
+// sphere_intersection() on all lanes at once, with the same operations in 
+// the same order so both give identical distances. Returns the lane of the 
+// closest hit before t_max and its distance in t, or -1.
+int sphere_pack_intersection(const SpherePack &pack, const Ray &ray, 
+float t_max, float &t)
+{
+    float4 oc_x = float4(ray.origin.coord[0]) - float4::load(pack.center[0]);
+    float4 oc_y = float4(ray.origin.coord[1]) - float4::load(pack.center[1]);
+    float4 oc_z = float4(ray.origin.coord[2]) - float4::load(pack.center[2]);
+    float4 radius = float4::load(pack.radius);
+    float4 b = float4(ray.direction.coord[0]) * oc_x + 
+    float4(ray.direction.coord[1]) * oc_y + 
+    float4(ray.direction.coord[2]) * oc_z;
+    float4 c = (oc_x * oc_x + oc_y * oc_y + oc_z * oc_z) - radius * radius;
+    float4 discriminant = b * b - c;
+    float4 zero = float4(0.0f);
+    float4 root = sqrt4(max4(discriminant, zero));
+    float4 near = zero - b - root;
+    float4 far = zero - b + root;
+    float4 dist = select(near > zero, near, far);
+    float4 hit = (discriminant >= zero) & (dist > zero) & 
+    (dist < float4(t_max));
+    int mask = movemask(hit);
+    if (mask == 0)
+    {
+        return -1;
+    }
+
+    float lanes[PACK_WIDTH];
+    dist.store(lanes);
+    int result = -1;
+    t = t_max;
+    for (int lane = 0; lane < PACK_WIDTH; lane++)
+    {
+        if ((mask & (1 << lane)) && lanes[lane] < t)
+        {
+            t = lanes[lane];
+            result = lane;
+        }
+    }
+    return result;
+}
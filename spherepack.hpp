@@ -0,0 +1,22 @@
+#ifndef SPHEREPACK_H
+#define SPHEREPACK_H
+#include "vec3.hpp"
+#include "geometry.hpp"
+#include "tripack.hpp"
+
+// Spheres stored SoA as center[axis][lane] and radius[lane], tested against 
+// one ray at once like a TrianglePack. Empty lanes are NaN and never hit.
+class SpherePack
+{
+    public:
+        float center[3][PACK_WIDTH];
+        float radius[PACK_WIDTH];
+        unsigned int id[PACK_WIDTH];
+};
+
+SpherePack make_sphere_pack(const vec3 *centers, const float *radii, 
+const unsigned int *ids, int count);
+
+int sphere_pack_intersection(const SpherePack &pack, const Ray &ray, 
+float t_max, float &t);
+#endif
@@ -0,0 +1,1116 @@
+#include "raytracer.hpp"
+#include "loader.hpp"
+#include "kdtree.hpp"
+#include "bvh.hpp"
+#include "bvh4.hpp"
+#include "tree_cache.hpp"
+#include "instance.hpp"
+#include "tripack.hpp"
+#include "framebuffer.hpp"
+#include "image_writer.hpp"
+#include "drawer.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+// Random rays shot at each tree
+#define TEST_RAYS 20000
+// Rays shot at the instanced scene, each one tested against every triangle
+#define INSTANCE_RAYS 1000
+// Fans of triangles shot at their shared edges and vertex
+#define TEST_FANS 300
+#define FAN_SIZE 7
+// Box around the test scene
+#define SCENE_MIN vec3(-10, -10, -10)
+#define SCENE_MAX vec3(10, 10, 10)
+
+int checks = 0;
+int failures = 0;
+
+void check(bool ok, const std::string &name)
+{
+    checks++;
+    if (!ok)
+    {
+        failures++;
+        std::cout << "FAIL " << name << std::endl;
+    }
+}
+
+float random_float(float lo, float hi)
+{
+    return lo + (hi - lo) * rand() / RAND_MAX;
+}
+
+vec3 random_vec(float lo, float hi)
+{
+    return vec3(random_float(lo, hi), random_float(lo, hi), 
+    random_float(lo, hi));
+}
+
+// The pack kernels and the scalar ones round differently
+bool close(float a, float b)
+{
+    return a == b || fabsf(a - b) <= 1e-4f * std::max(1.0f, fabsf(b));
+}
+
+float brute_force(const PrimStore &store, const Ray &ray)
+{
+    float best = INFINITY;
+    for (unsigned int i = 0; i < store.refs.size(); i++)
+    {
+        best = std::min(best, store.intersection(store.refs[i], ray));
+    }
+    return best;
+}
+
+// Closest hits and occlusion of random rays from inside the room, against 
+// testing every primitive
+void check_tree(const Accel &t, const PrimStore &store, 
+const std::string &name)
+{
+    int closest_wrong = 0;
+    int occluded_wrong = 0;
+    srand(11);
+    for (int i = 0; i < TEST_RAYS; i++)
+    {
+        vec3 origin = random_vec(-9, 9);
+        vec3 direction = random_vec(-1, 1).normalize();
+        float expected = brute_force(store, Ray(origin, direction));
+        if (!close(t.intersect(origin, direction).t, expected))
+        {
+            closest_wrong++;
+        }
+        float max_dist = random_float(0, 20);
+        if (fabsf(expected - max_dist) > 1e-3f && 
+        t.occluded(origin, direction, max_dist) != (expected < max_dist))
+        {
+            occluded_wrong++;
+        }
+    }
+    check(closest_wrong == 0, name + " closest hits, " + 
+    std::to_string(closest_wrong) + " wrong");
+    check(occluded_wrong == 0, name + " occlusion, " + 
+    std::to_string(occluded_wrong) + " wrong");
+}
+
+// The room, spheres placed as shapes, the teapot and a sphere field, so 
+// every primitive type is in the trees
+class TestScene
+{
+    public:
+        std::vector<Triangle> room;
+        std::vector<Sphere> balls;
+        std::vector<Shape*> scenery;
+        std::shared_ptr<TriMesh> object;
+        std::shared_ptr<SphereField> field;
+        TestScene();
+        TestScene(const TestScene&) = delete;
+        TestScene& operator=(const TestScene&) = delete;
+        PrimStore store() const
+        {
+            return PrimStore(scenery, object, field);
+        }
+};
+
+TestScene::TestScene()
+{
+    room.resize(12);
+    aa_room(vec3(), vec3(9.5, 9.5, 9.5), room.data(), scenery, {MIRROR, 
+    RED, GREEN, PURPLE, BLUE, BLACK});
+    balls.resize(20);
+    srand(5);
+    for (unsigned int i = 0; i < balls.size(); i++)
+    {
+        balls[i] = Sphere(random_vec(-8, 8), random_float(.1, 1));
+        scenery.push_back(&balls[i]);
+    }
+    object = std::make_shared<TriMesh>(load_trimesh("teapot.obj", GREEN));
+    place(*object, *object, vec3(), vec3(2, 2, 2));
+    field = std::make_shared<SphereField>();
+    sphere_populator(vec3(-9, -9, -9), vec3(9, 9, 9), 200, .4, *field);
+}
+
+void test_kdtree()
+{
+    TestScene scene;
+    PrimStore store = scene.store();
+    check_tree(kdtree(SCENE_MIN, SCENE_MAX, store, 4, 40, SAH), store, 
+    "kd-tree");
+}
+
+// Midpoint trees are deeper and repeat primitives across many more leaves 
+// of the flat node array
+void test_midpoint_kdtree()
+{
+    TestScene scene;
+    PrimStore store = scene.store();
+    check_tree(kdtree(SCENE_MIN, SCENE_MAX, store, 4, 20, MIDPOINT), store, 
+    "midpoint kd-tree");
+}
+
+void test_bvh()
+{
+    TestScene scene;
+    PrimStore store = scene.store();
+    check_tree(bvh(store, 4), store, "bvh");
+}
+
+void test_bvh4()
+{
+    TestScene scene;
+    PrimStore store = scene.store();
+    check_tree(bvh4(store, 4), store, "bvh4");
+}
+
+// Every third sphere and the teapot move after the trees are built, which 
+// then have to agree with the moved scene
+void test_update()
+{
+    TestScene scene;
+    PrimStore store = scene.store();
+    TriMesh rest = load_trimesh("teapot.obj", GREEN);
+    kdtree kd(SCENE_MIN, SCENE_MAX, store, 4, 40, SAH);
+    bvh binary(store, 4);
+    bvh4 wide(store, 4);
+    srand(7);
+    for (unsigned int i = 0; i < scene.balls.size(); i += 3)
+    {
+        scene.balls[i] = Sphere(random_vec(-8, 8), random_float(.1, 1));
+    }
+    place(*scene.object, rest, vec3(1, 2, -1), vec3(2, 2, 2));
+    kd.update();
+    binary.update();
+    wide.update();
+    PrimStore moved = scene.store();
+    check_tree(kd, moved, "updated kd-tree");
+    check_tree(binary, moved, "updated bvh");
+    check_tree(wide, moved, "updated bvh4");
+}
+
+// Trees over the teapot stored on its 16 bit lattice, checked against the 
+// decoded triangles
+void test_quantized()
+{
+    TestScene scene;
+    scene.object->compress();
+    PrimStore store = scene.store();
+    check_tree(kdtree(SCENE_MIN, SCENE_MAX, store, 4, 40, SAH), store, 
+    "quantized kd-tree");
+    check_tree(bvh(store, 4), store, "quantized bvh");
+    check_tree(bvh4(store, 4), store, "quantized bvh4");
+}
+
+// Every half converts to a float and back to itself
+void test_half()
+{
+    int wrong = 0;
+    for (unsigned int h = 0; h < 0x10000; h++)
+    {
+        float x = half_to_float(h);
+        if (x != x)
+        {
+            unsigned short back = float_to_half(x);
+            wrong += (back & 0x7c00) != 0x7c00 || (back & 0x3ff) == 0;
+            continue;
+        }
+        wrong += float_to_half(x) != h;
+    }
+    check(wrong == 0, "half round trip, " + std::to_string(wrong) + 
+    " wrong");
+    check(float_to_half(1) == 0x3c00, "half of 1");
+    check(float_to_half(-2) == 0xc000, "half of -2");
+    check(float_to_half(65504) == 0x7bff, "largest half");
+    check(float_to_half(65520) == 0x7c00, "half overflow");
+    check(float_to_half(INFINITY) == 0x7c00, "half infinity");
+    check(float_to_half(ldexpf(1, -24)) == 1, "smallest subnormal half");
+    check(float_to_half(ldexpf(1, -25)) == 0, "half tie to even zero");
+    check(float_to_half(1 + ldexpf(1, -11)) == 0x3c00, "half tie down");
+    check(float_to_half(1 + 3 * ldexpf(1, -11)) == 0x3c02, "half tie up");
+}
+
+std::vector<unsigned char> read_file(const std::string &path)
+{
+    std::vector<unsigned char> result;
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+    {
+        return result;
+    }
+    unsigned char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        result.insert(result.end(), buffer, buffer + count);
+    }
+    fclose(file);
+    return result;
+}
+
+void write_file(const std::string &path, 
+const std::vector<unsigned char> &bytes)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    fwrite(bytes.data(), 1, bytes.size(), file);
+    fclose(file);
+}
+
+// Skips the text header of a PPM, PFM or HDR file, which ends after the 
+// given number of lines
+size_t skip_lines(const std::vector<unsigned char> &bytes, int lines)
+{
+    size_t pos = 0;
+    while (lines > 0 && pos < bytes.size())
+    {
+        lines -= bytes[pos] == '\n';
+        pos++;
+    }
+    return pos;
+}
+
+unsigned int big_endian(const unsigned char *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+bool check_ppm(const Framebuffer &frame, const std::vector<unsigned char> &b)
+{
+    std::string header = "P6\n" + std::to_string(frame.width) + " " + 
+    std::to_string(frame.height) + "\n255\n";
+    size_t pos = skip_lines(b, 3);
+    if (std::string(b.begin(), b.begin() + pos) != header || 
+    b.size() != pos + 3 * frame.width * frame.height)
+    {
+        return false;
+    }
+    for (int i = 0; i < frame.height; i++)
+    {
+        for (int j = 0; j < frame.width; j++)
+        {
+            vec3 color = frame.get(i, j);
+            for (int k = 0; k < 3; k++)
+            {
+                if (b[pos++] != to_byte(color.coord[k]))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Rows are stored bottom up, a negative scale means little endian
+bool check_pfm(const Framebuffer &frame, const std::vector<unsigned char> &b)
+{
+    size_t pos = skip_lines(b, 3);
+    if (b.size() != pos + 12 * frame.width * frame.height)
+    {
+        return false;
+    }
+    for (int i = frame.height - 1; i >= 0; i--)
+    {
+        for (int j = 0; j < frame.width; j++)
+        {
+            vec3 color = frame.get(i, j);
+            for (int k = 0; k < 3; k++)
+            {
+                float x;
+                memcpy(&x, &b[pos], 4);
+                pos += 4;
+                if (x != color.coord[k])
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Decodes flat and run length scanlines. RGBE keeps 8 bits of mantissa 
+// for the brightest channel, so every channel is within 1/128 of it.
+bool check_hdr(const Framebuffer &frame, const std::vector<unsigned char> &b)
+{
+    std::string size_line = "-Y " + std::to_string(frame.height) + " +X " + 
+    std::to_string(frame.width) + "\n";
+    size_t pos = skip_lines(b, 4);
+    if (std::string(b.begin() + skip_lines(b, 3), b.begin() + pos) != 
+    size_line)
+    {
+        return false;
+    }
+    std::vector<unsigned char> rgbe(4 * frame.width);
+    for (int i = 0; i < frame.height; i++)
+    {
+        if (pos + 4 <= b.size() && b[pos] == 2 && b[pos + 1] == 2)
+        {
+            pos += 4;
+            for (int k = 0; k < 4; k++)
+            {
+                int j = 0;
+                while (j < frame.width && pos < b.size())
+                {
+                    int count = b[pos++];
+                    if (count > 128)
+                    {
+                        for (int r = 0; r < count - 128; r++)
+                        {
+                            rgbe[4 * j++ + k] = b[pos];
+                        }
+                        pos++;
+                        continue;
+                    }
+                    for (int r = 0; r < count; r++)
+                    {
+                        rgbe[4 * j++ + k] = b[pos++];
+                    }
+                }
+            }
+        }
+        else
+        {
+            std::copy(b.begin() + pos, b.begin() + pos + rgbe.size(), 
+            rgbe.begin());
+            pos += rgbe.size();
+        }
+        for (int j = 0; j < frame.width; j++)
+        {
+            vec3 color = frame.get(i, j);
+            float brightest = std::max(color.coord[0], 
+            std::max(color.coord[1], color.coord[2]));
+            for (int k = 0; k < 3; k++)
+            {
+                float x = rgbe[4 * j + 3] == 0 ? 0 : 
+                ldexpf(rgbe[4 * j + k], rgbe[4 * j + 3] - 136);
+                float expected = std::max(color.coord[k], 0.0f);
+                if (fabsf(x - expected) > std::max(brightest, 0.0f) / 128)
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return pos == b.size();
+}
+
+// Checks the chunk CRCs, inflates the IDAT data and undoes the row filters
+bool check_png(const Framebuffer &frame, const std::vector<unsigned char> &b)
+{
+    const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, 
+    '\n'};
+    if (b.size() < 8 || memcmp(b.data(), signature, 8) != 0)
+    {
+        return false;
+    }
+    std::vector<unsigned char> compressed;
+    size_t pos = 8;
+    bool ended = false;
+    while (!ended && pos + 12 <= b.size())
+    {
+        unsigned int size = big_endian(&b[pos]);
+        if (pos + 12 + size > b.size())
+        {
+            return false;
+        }
+        const unsigned char *type = &b[pos + 4];
+        const unsigned char *data = &b[pos + 8];
+        if (crc32(crc32(0, type, 4), data, size) != 
+        big_endian(data + size))
+        {
+            return false;
+        }
+        if (memcmp(type, "IHDR", 4) == 0)
+        {
+            const unsigned char expected[5] = {8, 2, 0, 0, 0};
+            if (size != 13 || 
+            big_endian(data) != (unsigned int) frame.width || 
+            big_endian(data + 4) != (unsigned int) frame.height || 
+            memcmp(data + 8, expected, 5) != 0)
+            {
+                return false;
+            }
+        }
+        else if (memcmp(type, "IDAT", 4) == 0)
+        {
+            compressed.insert(compressed.end(), data, data + size);
+        }
+        ended = memcmp(type, "IEND", 4) == 0;
+        pos += 12 + size;
+    }
+    int stride = 3 * frame.width;
+    std::vector<unsigned char> raw((stride + 1) * frame.height + 1);
+    uLongf raw_size = raw.size();
+    if (!ended || pos != b.size() || uncompress(raw.data(), &raw_size, 
+    compressed.data(), compressed.size()) != Z_OK || 
+    raw_size != raw.size() - 1)
+    {
+        return false;
+    }
+    std::vector<unsigned char> previous(stride, 0);
+    std::vector<unsigned char> row(stride);
+    for (int i = 0; i < frame.height; i++)
+    {
+        const unsigned char *line = &raw[i * (stride + 1)];
+        for (int x = 0; x < stride; x++)
+        {
+            int left = x >= 3 ? row[x - 3] : 0;
+            int up = previous[x];
+            int up_left = x >= 3 ? previous[x - 3] : 0;
+            int predicted = 0;
+            switch (line[0])
+            {
+                case 0:
+                    break;
+                case 1:
+                    predicted = left;
+                    break;
+                case 2:
+                    predicted = up;
+                    break;
+                case 3:
+                    predicted = (left + up) / 2;
+                    break;
+                case 4:
+                {
+                    int estimate = left + up - up_left;
+                    int d_left = abs(estimate - left);
+                    int d_up = abs(estimate - up);
+                    int d_up_left = abs(estimate - up_left);
+                    predicted = d_left <= d_up && d_left <= d_up_left ? 
+                    left : d_up <= d_up_left ? up : up_left;
+                    break;
+                }
+                default:
+                    return false;
+            }
+            row[x] = line[x + 1] + predicted;
+        }
+        for (int j = 0; j < frame.width; j++)
+        {
+            vec3 color = frame.get(i, j);
+            for (int k = 0; k < 3; k++)
+            {
+                if (row[3 * j + k] != to_byte(color.coord[k]))
+                {
+                    return false;
+                }
+            }
+        }
+        row.swap(previous);
+    }
+    return true;
+}
+
+// Writes an image in two bands with every writer and decodes the files 
+// again. The narrow image has flat HDR scanlines, the wide one run length 
+// encoded ones.
+void test_writers()
+{
+    const int widths[2] = {5, 150};
+    for (int w = 0; w < 2; w++)
+    {
+        Framebuffer frame(widths[w], 7, FLOAT32);
+        for (int i = 0; i < frame.height; i++)
+        {
+            for (int j = 0; j < frame.width; j++)
+            {
+                frame.set(i, j, vec3((i * 5 + j) % 9 / 6.0f, 
+                j % 4 == 0 ? 0 : j / 97.0f, i == 3 ? -.25f : 1e-3f * i));
+            }
+        }
+        std::string size = " " + std::to_string(frame.width) + "x" + 
+        std::to_string(frame.height);
+        const char *types[4] = {"ppm", "pfm", "hdr", "png"};
+        for (int f = 0; f < 4; f++)
+        {
+            std::string path = std::string("tests_image.") + types[f];
+            std::shared_ptr<ImageWriter> writer = open_image(path, 
+            frame.width, frame.height);
+            bool written = writer != NULL;
+            if (written)
+            {
+                writer->write_rows(frame, 0, 3);
+                writer->write_rows(frame, 3, frame.height - 3);
+                written = writer->finish();
+                writer.reset();
+            }
+            std::vector<unsigned char> bytes = read_file(path);
+            bool decoded = false;
+            switch (f)
+            {
+                case 0:
+                    decoded = check_ppm(frame, bytes);
+                    break;
+                case 1:
+                    decoded = check_pfm(frame, bytes);
+                    break;
+                case 2:
+                    decoded = check_hdr(frame, bytes);
+                    break;
+                default:
+                    decoded = check_png(frame, bytes);
+            }
+            check(written && decoded, std::string(types[f]) + " writer" + 
+            size);
+            remove(path.c_str());
+        }
+    }
+}
+
+// Saves a tree, then loads it back intact and from damaged copies, which 
+// have to be turned down with the tree left empty
+void test_tree_cache()
+{
+    TestScene scene;
+    PrimStore store = scene.store();
+    kdtree t(SCENE_MIN, SCENE_MAX, store, 4, 40, SAH);
+    unsigned long long key = tree_key(SCENE_MIN, SCENE_MAX, store, 4, 40, SAH);
+    std::string path = "tests_tree.bin";
+    check(save_tree(t, key, path), "save tree");
+
+    kdtree loaded;
+    check(load_tree(loaded, key, path, store) && 
+    loaded.nodes.size() == t.nodes.size() && 
+    loaded.prim_indices == t.prim_indices, "load tree");
+    check_tree(loaded, store, "loaded kd-tree");
+    check(!load_tree(loaded, key + 1, path, store) && loaded.nodes.empty(), 
+    "tree with another key rejected");
+
+    std::vector<unsigned char> good = read_file(path);
+    size_t nodes_start = sizeof(TreeCacheHeader);
+    size_t indices_start = nodes_start + t.nodes.size() * sizeof(FlatNode);
+    unsigned int first_leaf = 0;
+    while (!t.nodes[first_leaf].isLeaf() || 
+    t.nodes[first_leaf].num_prims() == 0)
+    {
+        first_leaf++;
+    }
+    for (int damage = 0; damage < 6; damage++)
+    {
+        std::vector<unsigned char> bad = good;
+        std::string name;
+        FlatNode *nodes = (FlatNode*) &bad[nodes_start];
+        unsigned int *indices = (unsigned int*) &bad[indices_start];
+        switch (damage)
+        {
+            case 0:
+                bad.resize(bad.size() - 4);
+                name = "truncated";
+                break;
+            case 1:
+                bad[0] ^= 0xff;
+                name = "bad magic";
+                break;
+            case 2:
+                nodes[0].flags = ((unsigned int) t.nodes.size() << 2) | 
+                nodes[0].split_axis();
+                name = "child past the end";
+                break;
+            case 3:
+                nodes[0].flags = nodes[0].split_axis();
+                name = "child before its parent";
+                break;
+            case 4:
+                nodes[first_leaf].prim_offset = t.prim_indices.size();
+                name = "leaf past the indices";
+                break;
+            default:
+                indices[0] = prim_ref(TRIANGLE, 1000);
+                name = "unknown primitive";
+        }
+        write_file(path, bad);
+        check(!load_tree(loaded, key, path, store) && loaded.nodes.empty(), 
+        "tree with " + name + " rejected");
+    }
+    remove(path.c_str());
+}
+
+// Rays aimed exactly at the spokes and the center of bumpy fans of 
+// triangles, from above or below, must hit at least one triangle of the 
+// fan. Points on a spoke aren't representable, so each ray lands on one 
+// side of it or on it, and a gap between the two triangles would let it 
+// through.
+void test_watertight()
+{
+    int scalar_missed = 0;
+    int pack_missed = 0;
+    int rays = 0;
+    srand(17);
+    for (int f = 0; f < TEST_FANS; f++)
+    {
+        vec3 center = random_vec(-5, 5);
+        vec3 n = random_vec(-1, 1).normalize();
+        vec3 a = n.crossProduct(vec3(.3, 1, .7)).normalize();
+        vec3 b = n.crossProduct(a);
+        vec3 ring[FAN_SIZE];
+        for (int i = 0; i < FAN_SIZE; i++)
+        {
+            float angle = 2 * M_PI * (i + random_float(-.3, .3)) / FAN_SIZE;
+            float radius = random_float(.5, 3);
+            ring[i] = center + radius * cos(angle) * a + 
+            radius * sin(angle) * b + random_float(-.1, .1) * radius * n;
+        }
+        TriangleVerts fan[FAN_SIZE];
+        unsigned int ids[FAN_SIZE];
+        for (int i = 0; i < FAN_SIZE; i++)
+        {
+            fan[i] = TriangleVerts{center, ring[i], ring[(i + 1) % FAN_SIZE]};
+            ids[i] = i;
+        }
+        std::vector<TrianglePack> packs;
+        for (int i = 0; i < FAN_SIZE; i += PACK_WIDTH)
+        {
+            packs.push_back(make_pack(fan + i, ids + i, 
+            std::min(PACK_WIDTH, FAN_SIZE - i)));
+        }
+        std::vector<vec3> targets = {center};
+        for (int i = 0; i < FAN_SIZE; i++)
+        {
+            for (int k = 1; k < 8; k++)
+            {
+                targets.push_back(center + k / 8.0f * (ring[i] - center));
+            }
+        }
+        for (unsigned int i = 0; i < targets.size(); i++)
+        {
+            for (int side = -1; side <= 1; side += 2)
+            {
+                vec3 origin = targets[i] + 
+                random_float(2, 10) * (side * n + random_vec(-.4, .4));
+                Ray ray(origin, (targets[i] - origin).normalize());
+                float t;
+                float u;
+                float v;
+                bool scalar_hit = false;
+                for (int k = 0; k < FAN_SIZE; k++)
+                {
+                    scalar_hit = scalar_hit || triangle_intersection(fan[k].v0, 
+                    fan[k].v1, fan[k].v2, ray, u, v) < INFINITY;
+                }
+                bool pack_hit = false;
+                for (unsigned int p = 0; p < packs.size(); p++)
+                {
+                    pack_hit = pack_hit || 
+                    pack_intersection(packs[p], ray, INFINITY, t, u, v) >= 0;
+                }
+                scalar_missed += !scalar_hit;
+                pack_missed += !pack_hit;
+                rays++;
+            }
+        }
+    }
+    check(scalar_missed == 0, "watertight triangles, " + 
+    std::to_string(scalar_missed) + " of " + std::to_string(rays) + 
+    " rays missed");
+    check(pack_missed == 0, "watertight triangle packs, " + 
+    std::to_string(pack_missed) + " of " + std::to_string(rays) + 
+    " rays missed");
+}
+
+// Scale along the axes, then a turn around y, then a move to pos
+Transform turn_scale(vec3 pos, float angle, vec3 scaler)
+{
+    Transform result = translate_scale(pos, scaler);
+    result.m[0][0] = cos(angle) * scaler.coord[0];
+    result.m[0][2] = sin(angle) * scaler.coord[2];
+    result.m[2][0] = -sin(angle) * scaler.coord[0];
+    result.m[2][2] = cos(angle) * scaler.coord[2];
+    return result;
+}
+
+// Rays aimed at random instances and at nothing in particular, against 
+// every triangle of every instance moved to world space. The hit triangle 
+// may be another one only when it is as close, as on a shared edge.
+void check_instances(const tlas &top, const TriMesh &mesh, 
+const std::vector<Transform> &placements, const std::string &name)
+{
+    std::vector<TriangleVerts> world;
+    for (unsigned int id = 0; id < placements.size(); id++)
+    {
+        for (unsigned int i = 0; i < mesh.size(); i++)
+        {
+            world.push_back(TriangleVerts{
+            placements[id].point(mesh.vertex(i, 0)), 
+            placements[id].point(mesh.vertex(i, 1)), 
+            placements[id].point(mesh.vertex(i, 2))});
+        }
+    }
+    int closest_wrong = 0;
+    int prim_wrong = 0;
+    int normal_wrong = 0;
+    int occluded_wrong = 0;
+    srand(13);
+    for (int r = 0; r < INSTANCE_RAYS; r++)
+    {
+        vec3 origin = random_vec(-9, 9);
+        vec3 target = random_vec(-1, 1);
+        if (r % 2 == 0)
+        {
+            target = target + placements[r / 2 % placements.size()].point(
+            vec3());
+        }
+        vec3 direction = (target - origin).normalize();
+        Ray ray(origin, direction);
+        float u;
+        float v;
+        float expected = INFINITY;
+        unsigned int best = 0;
+        for (unsigned int i = 0; i < world.size(); i++)
+        {
+            float t = triangle_intersection(world[i].v0, world[i].v1, 
+            world[i].v2, ray, u, v);
+            if (t < expected)
+            {
+                expected = t;
+                best = i;
+            }
+        }
+        Hit hit = top.intersect(origin, direction);
+        if (!close(hit.t, expected))
+        {
+            closest_wrong++;
+        }
+        else if (hit.t < INFINITY)
+        {
+            unsigned int id = 0;
+            while (id < placements.size() && 
+            hit.instance != &top.instances[top.slots[id]])
+            {
+                id++;
+            }
+            unsigned int tri = ref_index(hit.prim);
+            unsigned int got = id * mesh.size() + tri;
+            if (id == placements.size() || tri >= mesh.size() || (got != best 
+            && !close(triangle_intersection(world[got].v0, world[got].v1, 
+            world[got].v2, ray, u, v), expected)))
+            {
+                prim_wrong++;
+                continue;
+            }
+            vec3 n = (world[got].v1 - world[got].v0).crossProduct(
+            world[got].v2 - world[got].v0).normalize();
+            vec3 object_n = (mesh.vertex(tri, 1) - mesh.vertex(tri, 0)).
+            crossProduct(mesh.vertex(tri, 2) - mesh.vertex(tri, 0));
+            if (fabsf(hit.instance->normal_to_world(object_n) * n) < .999f)
+            {
+                normal_wrong++;
+            }
+        }
+        float max_dist = random_float(0, 20);
+        if (fabsf(expected - max_dist) > 1e-3f && 
+        top.occluded(origin, direction, max_dist) != (expected < max_dist))
+        {
+            occluded_wrong++;
+        }
+    }
+    check(closest_wrong == 0, name + " closest hits, " + 
+    std::to_string(closest_wrong) + " wrong");
+    check(prim_wrong == 0, name + " hit triangles, " + 
+    std::to_string(prim_wrong) + " wrong");
+    check(normal_wrong == 0, name + " normals, " + 
+    std::to_string(normal_wrong) + " wrong");
+    check(occluded_wrong == 0, name + " occlusion, " + 
+    std::to_string(occluded_wrong) + " wrong");
+}
+
+// Copies of the teapot sharing a kd-tree or a BVH, stretched unevenly and 
+// turned, then some of them moved
+void test_instances()
+{
+    std::shared_ptr<Mesh> kd_mesh = std::make_shared<Mesh>("teapot.obj", 
+    GREEN, "kdtree", 4);
+    std::shared_ptr<Mesh> bvh_mesh = std::make_shared<Mesh>("teapot.obj", 
+    GREEN, "bvh", 4);
+    std::vector<Transform> placements = {
+    translate_scale(vec3(-5, 0, 0), vec3(1, 1, 1)), 
+    translate_scale(vec3(4, 2, -3), vec3(2, .5, 1)), 
+    turn_scale(vec3(0, -4, 4), .7, vec3(.5, 1.5, 1)), 
+    turn_scale(vec3(3, -3, 3), 2, vec3(1.5, 1, .3)), 
+    turn_scale(vec3(-3, 4, -4), -1, vec3(.8, 2, 1.2))};
+    std::vector<Instance> instances;
+    for (unsigned int i = 0; i < placements.size(); i++)
+    {
+        instances.push_back(Instance(i % 2 ? bvh_mesh : kd_mesh, 
+        placements[i]));
+    }
+    tlas top(instances);
+    check_instances(top, *kd_mesh->geometry, placements, "instances");
+
+    placements[1] = turn_scale(vec3(-4, -5, 2), 1.2, vec3(1, 1.8, .6));
+    placements[4] = translate_scale(vec3(5, 5, 5), vec3(.4, 1, 2));
+    top.set_transform(1, placements[1]);
+    top.set_transform(4, placements[4]);
+    top.update();
+    check_instances(top, *kd_mesh->geometry, placements, "moved instances");
+}
+
+// Camera of main.cpp looking at the scene, the caller frees mat
+View test_view(const Accel &t, const std::vector<Light> &lights)
+{
+    View view;
+    view.t = &t;
+    view.lights = &lights;
+    view.eye = vec3(5, 0, -5);
+    view.mat = lookAtMatrix(view.eye, vec3(), vec3(0, 1, 0));
+    view.fov = FOV;
+    view.depth = 0;
+    return view;
+}
+
+// draw() with the camera of test_view into a file that is removed again, 
+// returning what it printed
+std::string quiet_draw(const Accel &t, std::vector<Light> &lights, 
+Framebuffer &frame, const RenderBudget &budget, int aa_levels)
+{
+    std::string path = "tests_draw.pfm";
+    std::stringstream log;
+    std::streambuf *out = std::cout.rdbuf(log.rdbuf());
+    draw(t, lights, vec3(5, 0, -5), vec3(), vec3(0, 1, 0), IOR, 0, BIAS, FOV, 
+    path, frame, budget, aa_levels);
+    std::cout.rdbuf(out);
+    remove(path.c_str());
+    return log.str();
+}
+
+// Pixels holding count samples in a progressive render
+int pixels_with(const SampleSums &sums, int count)
+{
+    return std::count(sums.count.begin(), sums.count.end(), count);
+}
+
+// The coarse passes trace every pixel exactly once between them, each 
+// skipping what the one before traced, the noise estimate waits for two 
+// samples of every pixel, and a budget that has run out still leaves the 
+// whole image of the first pass
+void test_progressive()
+{
+    TestScene scene;
+    PrimStore store = scene.store();
+    bvh t(store, 4);
+    std::vector<Light> lights = {Light(vec3(0, 9, 0))};
+    View view = test_view(t, lights);
+    int rows = 21;
+    int cols = 37;
+    Framebuffer frame(cols, rows, FLOAT32);
+    SampleSums sums(cols, rows);
+    Pass pass;
+    bool exact = true;
+    for (int step = COARSE_STEP; step >= 1; step /= 2)
+    {
+        pass.step = step;
+        pass.coarser = step < COARSE_STEP ? 2 * step : 0;
+        long long rays = render_pass(view, pass, frame, &sums);
+        int traced = 0;
+        for (int i = 0; i < rows; i++)
+        {
+            for (int j = 0; j < cols; j++)
+            {
+                bool on_grid = i % step == 0 && j % step == 0;
+                exact = exact && sums.count[i * cols + j] == on_grid;
+                traced += on_grid;
+            }
+        }
+        int coarser = pass.coarser ? ((rows + pass.coarser - 1) / 
+        pass.coarser) * ((cols + pass.coarser - 1) / pass.coarser) : 0;
+        exact = exact && rays == traced - coarser;
+    }
+    check(exact, "coarse passes trace each pixel once");
+    check(sums.noise() == INFINITY, "no noise estimate from one sample");
+    pass.type = JITTER_PASS;
+    pass.index = 1;
+    pass.deadline = render_clock::now();
+    render_pass(view, pass, frame, &sums);
+    check(pixels_with(sums, 2) == 0 && sums.noise() == INFINITY, 
+    "expired jitter pass skipped");
+
+    SampleSums constant(3, 2);
+    for (int p = 0; p < 6; p++)
+    {
+        constant.add(p / 3, p % 3, vec3(1, 1, 1));
+    }
+    bool waits = constant.noise() == INFINITY;
+    for (int p = 0; p < 5; p++)
+    {
+        constant.add(p / 3, p % 3, vec3());
+        waits = waits && constant.noise() == INFINITY;
+    }
+    constant.add(1, 2, vec3());
+    check(waits && close(constant.noise(), .5), 
+    "noise waits for two samples of every pixel");
+    delete[] view.mat;
+
+    // A budget that rounds to no time at all and one over before the first 
+    // tile is done
+    float budgets[2] = {1e-30, 1e-9};
+    for (int b = 0; b < 2; b++)
+    {
+        for (int i = 0; i < rows; i++)
+        {
+            for (int j = 0; j < cols; j++)
+            {
+                frame.set(i, j, vec3(-1, -1, -1));
+            }
+        }
+        RenderBudget budget;
+        budget.seconds = budgets[b];
+        quiet_draw(t, lights, frame, budget, 0);
+        bool complete = true;
+        bool blocks = true;
+        for (int i = 0; i < rows; i++)
+        {
+            for (int j = 0; j < cols; j++)
+            {
+                complete = complete && !(frame.get(i, j) == vec3(-1, -1, -1));
+                blocks = blocks && frame.get(i, j) == 
+                frame.get(i - i % COARSE_STEP, j - j % COARSE_STEP);
+            }
+        }
+        std::string name = b ? "expired budget" : "zero-length budget";
+        check(complete, name + " leaves a whole image");
+        check(blocks, name + " stops after the first pass");
+    }
+}
+
+// Hands rays on to a tree and counts them
+class CountingAccel: public Accel
+{
+    public:
+        const Accel *t;
+        mutable std::atomic<long long> rays;
+        CountingAccel(const Accel &t): rays(0)
+        {
+            this->t = &t;
+            minBounds = t.minBounds;
+            maxBounds = t.maxBounds;
+        }
+        Hit intersect(vec3 origin, vec3 direction, float t_max) const
+        {
+            rays++;
+            return t->intersect(origin, direction, t_max);
+        }
+        bool occluded(vec3 origin, vec3 direction, float max_dist) const
+        {
+            return t->occluded(origin, direction, max_dist);
+        }
+        void update()
+        {
+        }
+};
+
+// A black ball on the gray background, unlit so its only edge is the 
+// silhouette. Only pixels whose center is on the other side of it from a 
+// neighbor's may be split, every split costs 4 rays, draw() has to report 
+// the rays it traced and the image has to stay within AA_CONTRAST of 
+// uniform supersampling as fine as the deepest split.
+void test_adaptive()
+{
+    Sphere ball(vec3(), 2);
+    std::vector<Shape*> scenery = {&ball};
+    bvh tree(PrimStore(scenery), 1);
+    CountingAccel t(tree);
+    std::vector<Light> lights;
+    View view = test_view(t, lights);
+    int rows = 24;
+    int cols = 32;
+    Framebuffer frame(cols, rows, FLOAT32);
+    std::vector<Sample> centers(rows * cols);
+    Pass pass;
+    pass.centers = &centers;
+    render_pass(view, pass, frame, NULL);
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
+        {
+            frame.set(i, j, vec3(-1, -1, -1));
+        }
+    }
+    pass.type = ADAPTIVE_PASS;
+    pass.levels = 1;
+    long long rays = render_pass(view, pass, frame, NULL);
+    int edges = 0;
+    bool only_edges = true;
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
+        {
+            bool inside = centers[i * cols + j].store != NULL;
+            bool edge = false;
+            for (int n = 0; n < 4; n++)
+            {
+                int y = i + (n == 0) - (n == 1);
+                int x = j + (n == 2) - (n == 3);
+                edge = edge || (y >= 0 && y < rows && x >= 0 && x < cols && 
+                (centers[y * cols + x].store != NULL) != inside);
+            }
+            bool split = !(frame.get(i, j) == vec3(-1, -1, -1));
+            only_edges = only_edges && split == edge;
+            edges += edge;
+        }
+    }
+    check(only_edges && edges > 0 && edges < rows * cols / 4, 
+    "only silhouette pixels split");
+    check(rays == 4 * edges, "4 rays per split");
+
+    for (int levels = 1; levels <= 3; levels++)
+    {
+        t.rays = 0;
+        std::string log = quiet_draw(t, lights, frame, RenderBudget(), levels);
+        size_t at = log.find("traced ");
+        long long reported = at == std::string::npos ? -1 : 
+        atoll(log.c_str() + at + 7);
+        std::string name = "adaptive " + std::to_string(1 << levels) + "x" + 
+        std::to_string(1 << levels);
+        check(reported == t.rays && 
+        (levels > 1 || reported == rows * cols + 4 * edges), 
+        name + " ray count");
+
+        // Uniform supersampling
+        int n = 1 << levels;
+        float worst = 0;
+        for (int i = 0; i < rows; i++)
+        {
+            for (int j = 0; j < cols; j++)
+            {
+                vec3 sum;
+                for (int s = 0; s < n * n; s++)
+                {
+                    sum += view.trace(i + (s / n + .5) / n, 
+                    j + (s % n + .5) / n, cols, rows);
+                }
+                vec3 error = frame.get(i, j) - (1.0 / (n * n)) * sum;
+                for (int k = 0; k < 3; k++)
+                {
+                    worst = std::max(worst, fabsf(error.coord[k]));
+                }
+            }
+        }
+        check(worst <= AA_CONTRAST, name + " off uniform supersampling by " + 
+        std::to_string(worst));
+    }
+    delete[] view.mat;
+}
+
+int main()
+{
+    test_kdtree();
+    test_midpoint_kdtree();
+    test_bvh();
+    test_bvh4();
+    test_update();
+    test_quantized();
+    test_tree_cache();
+    test_half();
+    test_writers();
+    test_watertight();
+    test_instances();
+    test_progressive();
+    test_adaptive();
+    std::cout << checks - failures << " of " << checks << 
+    " checks passed" << std::endl;
+    return failures > 0;
+}
@@ -0,0 +1,265 @@
+#include "tree_cache.hpp"
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+const char TREE_CACHE_MAGIC[4] = {'K', 'D', 'T', 'C'};
+
+// 64 bit FNV-1a
+void hash_bytes(unsigned long long &h, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+}
+
+void hash_vec(unsigned long long &h, vec3 v)
+{
+    hash_bytes(h, v.coord, sizeof(v.coord));
+}
+
+// Primitive order is part of the key since leaves store references by index
+unsigned long long tree_key(vec3 minBounds, vec3 maxBounds, 
+const PrimStore &store, int leaf_size, int max_depth, split_type mode)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    unsigned int version = TREE_CACHE_VERSION;
+    unsigned int num_prims = store.refs.size();
+    hash_bytes(h, &version, sizeof(version));
+    hash_bytes(h, &leaf_size, sizeof(leaf_size));
+    hash_bytes(h, &max_depth, sizeof(max_depth));
+    hash_bytes(h, &mode, sizeof(mode));
+    hash_vec(h, minBounds);
+    hash_vec(h, maxBounds);
+    hash_bytes(h, &num_prims, sizeof(num_prims));
+    for (unsigned int i = 0; i < store.sources.size(); i++)
+    {
+        const Shape *shape = store.sources[i];
+        const Triangle *tri = dynamic_cast<const Triangle*>(shape);
+        const Sphere *sphere = dynamic_cast<const Sphere*>(shape);
+        if (tri)
+        {
+            hash_vec(h, tri->v0);
+            hash_vec(h, tri->v1);
+            hash_vec(h, tri->v2);
+        }
+        else if (sphere)
+        {
+            hash_vec(h, sphere->pos);
+            hash_bytes(h, &sphere->radius, sizeof(sphere->radius));
+        }
+        std::pair<vec3, vec3> bound = shape->bounds();
+        hash_vec(h, bound.first);
+        hash_vec(h, bound.second);
+    }
+    if (store.mesh)
+    {
+        hash_bytes(h, store.mesh->vertices.data(), 
+        store.mesh->vertices.size() * sizeof(vec3));
+        hash_bytes(h, store.mesh->indices.data(), 
+        store.mesh->indices.size() * sizeof(unsigned int));
+        hash_bytes(h, store.mesh->quantized.data(), 
+        store.mesh->quantized.size() * sizeof(unsigned short));
+        hash_bytes(h, store.mesh->lattice_origin.data(), 
+        store.mesh->lattice_origin.size() * sizeof(vec3));
+        hash_bytes(h, store.mesh->lattice_step.data(), 
+        store.mesh->lattice_step.size() * sizeof(vec3));
+    }
+    if (store.field)
+    {
+        const SphereField &field = *store.field;
+        hash_bytes(h, field.x.data(), field.size() * sizeof(float));
+        hash_bytes(h, field.y.data(), field.size() * sizeof(float));
+        hash_bytes(h, field.z.data(), field.size() * sizeof(float));
+        hash_bytes(h, field.radius.data(), field.size() * sizeof(float));
+    }
+    return h;
+}
+
+std::string cache_path(std::string dir, unsigned long long key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "kdtree_%016llx.bin", key);
+    return dir + "/" + name;
+}
+
+// Writes to a temporary file first so a concurrent run never reads a half 
+// written tree
+bool save_tree(const kdtree &t, unsigned long long key, std::string path)
+{
+    TreeCacheHeader header;
+    memcpy(header.magic, TREE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = TREE_CACHE_VERSION;
+    header.key = key;
+    header.leaf_size = t.leaf_size;
+    header.max_depth = t.max_depth;
+    header.mode = t.mode;
+    header.num_prims = t.store.refs.size();
+    header.num_nodes = t.nodes.size();
+    header.num_indices = t.prim_indices.size();
+    for (int i = 0; i < 3; i++)
+    {
+        header.bounds[i] = t.minBounds.coord[i];
+        header.bounds[i + 3] = t.maxBounds.coord[i];
+    }
+
+    std::string tmp_path = path + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL)
+    {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(t.nodes.data(), sizeof(FlatNode), t.nodes.size(), 
+    file) == t.nodes.size();
+    ok = ok && fwrite(t.prim_indices.data(), sizeof(unsigned int), 
+    t.prim_indices.size(), file) == t.prim_indices.size();
+    ok = (fclose(file) == 0) && ok;
+    if (ok)
+    {
+        ok = rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+    if (!ok)
+    {
+        remove(tmp_path.c_str());
+    }
+    return ok;
+}
+
+// True if the reference names a primitive of the store
+bool valid_ref(const PrimStore &store, unsigned int ref)
+{
+    unsigned int i = ref_index(ref);
+    switch (ref_type(ref))
+    {
+        case TRIANGLE:
+            return i < store.triangles.size();
+        case SPHERE:
+            return i < store.spheres.size();
+        case MESH_TRIANGLE:
+            return store.mesh && i < store.mesh->size();
+        default:
+            return store.field && i < store.field->size();
+    }
+}
+
+// Walks the nodes once, checking that every child index is in the array 
+// and after its parent, that leaves stay inside prim_indices and name 
+// primitives of the store, and that no path is deeper than the traversal 
+// stack holds
+bool valid_tree(const kdtree &t)
+{
+    std::vector<std::pair<unsigned int, int>> todo;
+    todo.push_back(std::make_pair(0u, 0));
+    while (!todo.empty())
+    {
+        unsigned int n = todo.back().first;
+        int depth = todo.back().second;
+        todo.pop_back();
+        const FlatNode &node = t.nodes[n];
+        if (node.isLeaf())
+        {
+            unsigned long long end = (unsigned long long) node.prim_offset + 
+            node.num_prims();
+            if (end > t.prim_indices.size())
+            {
+                return false;
+            }
+            for (unsigned int i = node.prim_offset; i < end; i++)
+            {
+                if (!valid_ref(t.store, t.prim_indices[i]))
+                {
+                    return false;
+                }
+            }
+            continue;
+        }
+        if (depth >= KD_MAX_DEPTH || n + 1 >= t.nodes.size() || 
+        node.right() <= n + 1 || node.right() >= t.nodes.size())
+        {
+            return false;
+        }
+        todo.push_back(std::make_pair(n + 1, depth + 1));
+        todo.push_back(std::make_pair(node.right(), depth + 1));
+    }
+    return true;
+}
+
+// Reads the file straight into the tree's arrays and checks it against the 
+// key, the primitives and valid_tree(). Returns false for a missing, stale 
+// or corrupt file, leaving t to be built instead.
+bool load_tree(kdtree &t, unsigned long long key, std::string path, 
+const PrimStore &store)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+    struct stat info;
+    TreeCacheHeader header;
+    bool valid = fstat(fileno(file), &info) == 0 && 
+    fread(&header, sizeof(header), 1, file) == 1;
+    valid = valid && memcmp(header.magic, TREE_CACHE_MAGIC, 4) == 0 && 
+    header.version == TREE_CACHE_VERSION && header.key == key && 
+    header.num_prims == store.refs.size() && header.num_nodes > 0 && 
+    (size_t) info.st_size == sizeof(TreeCacheHeader) + 
+    header.num_nodes * sizeof(FlatNode) + 
+    header.num_indices * sizeof(unsigned int);
+    if (valid)
+    {
+        t.nodes.resize(header.num_nodes);
+        t.prim_indices.resize(header.num_indices);
+        valid = fread(t.nodes.data(), sizeof(FlatNode), header.num_nodes, 
+        file) == header.num_nodes && fread(t.prim_indices.data(), 
+        sizeof(unsigned int), header.num_indices, file) == 
+        header.num_indices;
+    }
+    fclose(file);
+    if (valid)
+    {
+        t.leaf_size = header.leaf_size;
+        t.max_depth = header.max_depth;
+        t.mode = (split_type) header.mode;
+        t.minBounds = vec3(header.bounds[0], header.bounds[1], 
+        header.bounds[2]);
+        t.maxBounds = vec3(header.bounds[3], header.bounds[4], 
+        header.bounds[5]);
+        t.store = store;
+        valid = valid_tree(t);
+    }
+    if (!valid)
+    {
+        t = kdtree();
+        return false;
+    }
+    build_packs(t);
+    t.record_bounds();
+    return true;
+}
+
+// Loads the tree for this input from dir, or builds it and saves it there
+std::shared_ptr<kdtree> cached_kdtree(vec3 minBounds, vec3 maxBounds, 
+const PrimStore &store, int leaf_size, int max_depth, split_type mode, 
+std::string dir)
+{
+    unsigned long long key = tree_key(minBounds, maxBounds, store, 
+    leaf_size, max_depth, mode);
+    std::string path = cache_path(dir, key);
+    std::shared_ptr<kdtree> result = std::make_shared<kdtree>();
+    if (load_tree(*result, key, path, store))
+    {
+        std::cout << "Loaded kd tree from " << path << std::endl;
+        return result;
+    }
+    result = std::make_shared<kdtree>(minBounds, maxBounds, store, 
+    leaf_size, max_depth, mode);
+    if (!save_tree(*result, key, path))
+    {
+        std::cerr << "Could not write kd tree cache " << path << std::endl;
+    }
+    return result;
+}
@@ -0,0 +1,46 @@
+#ifndef TREE_CACHE_H
+#define TREE_CACHE_H
+#include <string>
+#include <vector>
+#include <memory>
+#include "geometry.hpp"
+#include "kdtree.hpp"
+// Bump whenever FlatNode, the file layout or what the indices mean changes
+#define TREE_CACHE_VERSION 2
+
+// Start of a cached kd-tree file. It is followed by num_nodes FlatNodes 
+// and num_indices primitive references. The key hashes the geometry and the 
+// build parameters, so a file is only used for the exact same input.
+class TreeCacheHeader
+{
+    public:
+        char magic[4];
+        unsigned int version;
+        unsigned long long key;
+        int leaf_size;
+        int max_depth;
+        int mode;
+        unsigned int num_prims;
+        unsigned int num_nodes;
+        unsigned int num_indices;
+        float bounds[6];
+};
+
+unsigned long long tree_key(vec3 minBounds, vec3 maxBounds, 
+const PrimStore &store, int leaf_size, int max_depth, split_type mode);
+
+std::string cache_path(std::string dir, unsigned long long key);
+
+bool save_tree(const kdtree &t, unsigned long long key, std::string path);
+
+bool valid_ref(const PrimStore &store, unsigned int ref);
+
+bool valid_tree(const kdtree &t);
+
+bool load_tree(kdtree &t, unsigned long long key, std::string path, 
+const PrimStore &store);
+
+std::shared_ptr<kdtree> cached_kdtree(vec3 minBounds, vec3 maxBounds, 
+const PrimStore &store, int leaf_size, int max_depth, split_type mode, 
+std::string dir);
+#endif
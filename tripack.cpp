@@ -0,0 +1,156 @@
+#include "tripack.hpp"
+#include "simd.hpp"
+#include "prim_store.hpp"
+#include <cmath>
+
+// Fills the first count lanes with tris, ids are the primitive ids 
+// reported back for them
+TrianglePack make_pack(const TriangleVerts *tris, const unsigned int *ids, 
+int count)
+{
+    TrianglePack result;
+    for (int lane = 0; lane < PACK_WIDTH; lane++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            result.v[0][k][lane] = lane < count ? tris[lane].v0.coord[k] : NAN;
+            result.v[1][k][lane] = lane < count ? tris[lane].v1.coord[k] : NAN;
+            result.v[2][k][lane] = lane < count ? tris[lane].v2.coord[k] : NAN;
+        }
+        result.id[lane] = lane < count ? ids[lane] : PACK_EMPTY;
+    }
+    return result;
+}
+
+// ids are references to triangles of mesh, see prim_ref()
+MeshPack make_mesh_pack(const TriMesh &mesh, const unsigned int *ids, 
+int count)
+{
+    MeshPack result;
+    for (int lane = 0; lane < PACK_WIDTH; lane++)
+    {
+        unsigned int tri = ref_index(ids[lane < count ? lane : 0]);
+        for (int k = 0; k < 3; k++)
+        {
+            result.corner[k][lane] = lane < count ? 
+            mesh.indices[3 * tri + k] : 0;
+        }
+        result.id[lane] = lane < count ? ids[lane] : PACK_EMPTY;
+    }
+    return result;
+}
+
+// Triangle::intersection() on all lanes at once, with the same operations 
+// in the same order so both give identical distances. Returns the lane of 
+// the closest hit before t_max, its distance in t and its barycentrics in u 
+// and v, or -1.
+int pack_intersection(const TrianglePack &pack, const Ray &ray, float t_max, 
+float &t, float &u, float &v)
+{
+    int kx = ray.kx;
+    int ky = ray.ky;
+    int kz = ray.kz;
+    float4 o_x = float4(ray.origin.coord[kx]);
+    float4 o_y = float4(ray.origin.coord[ky]);
+    float4 o_z = float4(ray.origin.coord[kz]);
+    float4 s_x = float4(ray.sx);
+    float4 s_y = float4(ray.sy);
+    float4 a_z = float4::load(pack.v[0][kz]) - o_z;
+    float4 b_z = float4::load(pack.v[1][kz]) - o_z;
+    float4 c_z = float4::load(pack.v[2][kz]) - o_z;
+    float4 a_x = float4::load(pack.v[0][kx]) - o_x - s_x * a_z;
+    float4 a_y = float4::load(pack.v[0][ky]) - o_y - s_y * a_z;
+    float4 b_x = float4::load(pack.v[1][kx]) - o_x - s_x * b_z;
+    float4 b_y = float4::load(pack.v[1][ky]) - o_y - s_y * b_z;
+    float4 c_x = float4::load(pack.v[2][kx]) - o_x - s_x * c_z;
+    float4 c_y = float4::load(pack.v[2][ky]) - o_y - s_y * c_z;
+
+    float4 e_a = c_x * b_y - c_y * b_x;
+    float4 e_b = a_x * c_y - a_y * c_x;
+    float4 e_c = b_x * a_y - b_y * a_x;
+    float4 zero = float4(0.0f);
+    int exact = movemask((e_a == zero) | (e_b == zero) | (e_c == zero));
+    if (exact)
+    {
+        // Rare, redo the lanes with an exact zero in double precision
+        float ax[PACK_WIDTH], ay[PACK_WIDTH], bx[PACK_WIDTH], by[PACK_WIDTH];
+        float cx[PACK_WIDTH], cy[PACK_WIDTH];
+        float ea[PACK_WIDTH], eb[PACK_WIDTH], ec[PACK_WIDTH];
+        a_x.store(ax);
+        a_y.store(ay);
+        b_x.store(bx);
+        b_y.store(by);
+        c_x.store(cx);
+        c_y.store(cy);
+        e_a.store(ea);
+        e_b.store(eb);
+        e_c.store(ec);
+        for (int lane = 0; lane < PACK_WIDTH; lane++)
+        {
+            if (exact & (1 << lane))
+            {
+                ea[lane] = double(cx[lane]) * by[lane] - 
+                double(cy[lane]) * bx[lane];
+                eb[lane] = double(ax[lane]) * cy[lane] - 
+                double(ay[lane]) * cx[lane];
+                ec[lane] = double(bx[lane]) * ay[lane] - 
+                double(by[lane]) * ax[lane];
+            }
+        }
+        e_a = float4::load(ea);
+        e_b = float4::load(eb);
+        e_c = float4::load(ec);
+    }
+    float4 negative = (e_a < zero) | (e_b < zero) | (e_c < zero);
+    float4 positive = (e_a > zero) | (e_b > zero) | (e_c > zero);
+    float4 det = e_a + e_b + e_c;
+    float4 t_scaled = float4(ray.sz) * (e_a * a_z + e_b * b_z + e_c * c_z);
+    float4 inv_det = float4(1.0f) / det;
+    float4 dist = t_scaled * inv_det;
+    float4 hit = andnot(negative & positive, (det != zero) & 
+    (dist >= zero) & (dist < float4(t_max)));
+    int mask = movemask(hit);
+    if (mask == 0)
+    {
+        return -1;
+    }
+
+    float lanes[PACK_WIDTH];
+    dist.store(lanes);
+    int result = -1;
+    t = t_max;
+    for (int lane = 0; lane < PACK_WIDTH; lane++)
+    {
+        if ((mask & (1 << lane)) && lanes[lane] < t)
+        {
+            t = lanes[lane];
+            result = lane;
+        }
+    }
+    float weights[PACK_WIDTH];
+    (e_b * inv_det).store(weights);
+    u = weights[result];
+    (e_c * inv_det).store(weights);
+    v = weights[result];
+    return result;
+}
+
+// Gathers the corners into a TrianglePack on the stack and tests that
+int mesh_pack_intersection(const MeshPack &pack, const TriMesh &mesh, 
+const Ray &ray, float t_max, float &t, float &u, float &v)
+{
+    TrianglePack tris;
+    for (int lane = 0; lane < PACK_WIDTH; lane++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            vec3 corner = pack.id[lane] != PACK_EMPTY ? 
+            mesh.position(pack.corner[i][lane]) : vec3(NAN, NAN, NAN);
+            for (int k = 0; k < 3; k++)
+            {
+                tris.v[i][k][lane] = corner.coord[k];
+            }
+        }
+    }
+    return pack_intersection(tris, ray, t_max, t, u, v);
+}
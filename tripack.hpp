@@ -0,0 +1,42 @@
+#ifndef TRIPACK_H
+#define TRIPACK_H
+#include "vec3.hpp"
+#include "geometry.hpp"
+// Triangles tested together by one SIMD intersection
+#define PACK_WIDTH 4
+// id of a lane that holds no triangle
+#define PACK_EMPTY 0xffffffff
+
+// Triangles stored SoA as v[vertex][axis][lane] so one ray is tested 
+// against all of them at once. Empty lanes have NaN vertices, which fail 
+// every comparison in the test and never hit.
+class TrianglePack
+{
+    public:
+        float v[3][3][PACK_WIDTH];
+        unsigned int id[PACK_WIDTH];
+};
+
+// Triangles of a TriMesh kept as the indices of their corners, 
+// corner[vertex][lane], so a pack costs 16 bytes a triangle instead of 40. 
+// The corners are read from the mesh, and decoded from its lattice when 
+// it is compressed, as the pack is tested. Empty lanes have id PACK_EMPTY.
+class MeshPack
+{
+    public:
+        unsigned int corner[3][PACK_WIDTH];
+        unsigned int id[PACK_WIDTH];
+};
+
+TrianglePack make_pack(const TriangleVerts *tris, const unsigned int *ids, 
+int count);
+
+MeshPack make_mesh_pack(const TriMesh &mesh, const unsigned int *ids, 
+int count);
+
+int pack_intersection(const TrianglePack &pack, const Ray &ray, float t_max, 
+float &t, float &u, float &v);
+
+int mesh_pack_intersection(const MeshPack &pack, const TriMesh &mesh, 
+const Ray &ray, float t_max, float &t, float &u, float &v);
+#endif
@@ -22,13 +22,13 @@ class vec3
         }
         float norm() const
         {
-           return pow(coord[0] * coord[0] + coord[1] * coord[1] + 
-           coord[2] * coord[2], 0.5);
+           return sqrtf(coord[0] * coord[0] + coord[1] * coord[1] + 
+           coord[2] * coord[2]);
         }
         vec3 normalize() const
         {
-            float n = this->norm();
-            return vec3(coord[0] / n, coord[1] / n, coord[2] / n);
+            float inv_n = 1 / this->norm();
+            return vec3(coord[0] * inv_n, coord[1] * inv_n, coord[2] * inv_n);
         }
         vec3 crossProduct(const vec3 right) const
         {
@@ -88,12 +88,65 @@ class vec3
         }
 };
 
-vec3 operator+(vec3 left, vec3 right);
-vec3 operator-(vec3 left, vec3 right);
-float operator*(vec3 left, vec3 right);
-vec3 operator*(float scalar, vec3 right);
-vec3 operator/(vec3 left, float scalar);
-bool operator==(vec3 left, vec3 right);
+// The operators are used by every kernel and defined here so they inline 
+// into the other translation units
+inline vec3 operator+(vec3 left, vec3 right)
+{
+    return vec3(left.coord[0] + right.coord[0], left.coord[1] + right.coord[1], 
+    left.coord[2] + right.coord[2]);
+}
+
+inline vec3 operator-(vec3 left, vec3 right)
+{
+    return vec3(left.coord[0] - right.coord[0], left.coord[1] - right.coord[1], 
+    left.coord[2] - right.coord[2]);
+}
+
+// Dot product
+inline float operator*(vec3 left, vec3 right)
+{
+    return left.coord[0] * right.coord[0] + left.coord[1] * right.coord[1] + 
+    left.coord[2] * right.coord[2];
+}
+
+inline vec3 operator*(float scalar, vec3 right)
+{
+    return vec3(scalar * right.coord[0], scalar * right.coord[1], 
+    scalar * right.coord[2]);
+}
+
+inline vec3 operator/(vec3 left, float scalar)
+{
+    return (1 / scalar) * left;
+}
+
+inline bool operator==(vec3 left, vec3 right)
+{
+    return left.coord[0] == right.coord[0] && left.coord[1] == right.coord[1] 
+    && left.coord[2] == right.coord[2];
+}
+
+inline vec3 vec3::reflect(vec3 n) const
+{
+    return *this - (2 * (*this * n)) * n;
+}
+
+// https://stackoverflow.com/questions/29758545/how-to-find- 
+// refraction-vector-from-incoming-vector-and-surface-normal 
+// return 0 vector in case of total internal reflection
+inline vec3 vec3::refract(vec3 n, float ior1, float ior2) const
+{
+    float eta = ior1 / ior2;
+    float cosi = fabsf(n * *this);
+    float sint2 = eta * eta * (1 - cosi * cosi);
+    if (sint2 > 1)
+    {
+        return vec3(0, 0, 0);
+    }
+    float cost = sqrtf(1 - sint2);
+    return eta * *this + (eta * cosi - cost) * n;
+}
+
 float fresnel(vec3 n, vec3 direction, float ior1, float ior2);
 std::ostream& operator<<(std::ostream& os, const vec3 v);
 #endif
@@ -0,0 +1,144 @@
+#ifndef VEC4_H
+#define VEC4_H
+#include "vec3.hpp"
+#include "simd.hpp"
+
+// vec3 padded to one SSE register for math on values that are already in
+// registers, the fourth lane is kept at 0. vec3 stays the storage format,
+// its 12 bytes keep vertex buffers and the tree cache small.
+class vec4
+{
+    public:
+        float4 v;
+        vec4()
+        {
+            v = float4(0.0f);
+        }
+        vec4(float4 v)
+        {
+            this->v = v;
+        }
+        explicit vec4(vec3 a)
+        {
+#ifdef __SSE2__
+            v = _mm_setr_ps(a.coord[0], a.coord[1], a.coord[2], 0);
+#else
+            for (int i = 0; i < 3; i++)
+            {
+                v.v[i] = a.coord[i];
+            }
+            v.v[3] = 0;
+#endif
+        }
+        // Reads the vec3 with one unaligned load, so the four bytes after
+        // it must be readable, as they are for the bounds of a tree node
+        static vec4 load(const vec3 &a)
+        {
+#ifdef __SSE2__
+            __m128 xyz = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+            return float4(_mm_and_ps(_mm_loadu_ps(a.coord), xyz));
+#else
+            return vec4(a);
+#endif
+        }
+        vec3 xyz() const
+        {
+            float lanes[4];
+            v.store(lanes);
+            return vec3(lanes[0], lanes[1], lanes[2]);
+        }
+        vec4 operator-() const
+        {
+            return float4(0.0f) - v;
+        }
+        vec4& operator+=(vec4 right)
+        {
+            v = v + right.v;
+            return *this;
+        }
+        vec4 comp_mul(vec4 right) const
+        {
+            return v * right.v;
+        }
+        // 1 / x per component, the fourth lane stays 0
+        vec4 reciprocal() const;
+        float norm() const;
+        vec4 normalize() const;
+        vec4 crossProduct(vec4 right) const;
+        vec4 reflect(vec4 n) const;
+};
+
+inline vec4 operator+(vec4 left, vec4 right)
+{
+    return left.v + right.v;
+}
+
+inline vec4 operator-(vec4 left, vec4 right)
+{
+    return left.v - right.v;
+}
+
+inline vec4 operator*(float scalar, vec4 right)
+{
+    return float4(scalar) * right.v;
+}
+
+// Dot product broadcast to every lane
+inline float4 dot4(vec4 left, vec4 right)
+{
+#ifdef __SSE2__
+    __m128 m = _mm_mul_ps(left.v.v, right.v.v);
+    __m128 s = _mm_add_ps(m, _mm_movehl_ps(m, m));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_shuffle_ps(s, s, _MM_SHUFFLE(0, 0, 0, 0));
+#else
+    float4 m = left.v * right.v;
+    return float4(m.v[0] + m.v[1] + m.v[2]);
+#endif
+}
+
+// Dot product
+inline float operator*(vec4 left, vec4 right)
+{
+    float lanes[4];
+    dot4(left, right).store(lanes);
+    return lanes[0];
+}
+
+inline vec4 vec4::reciprocal() const
+{
+    float4 xyz = vec4(vec3(1, 1, 1)).v != float4(0.0f);
+    return select(xyz, float4(1.0f) / v, float4(0.0f));
+}
+
+inline float vec4::norm() const
+{
+    float lanes[4];
+    sqrt4(dot4(*this, *this)).store(lanes);
+    return lanes[0];
+}
+
+inline vec4 vec4::normalize() const
+{
+    return v * rsqrt4(dot4(*this, *this));
+}
+
+inline vec4 vec4::crossProduct(vec4 right) const
+{
+#ifdef __SSE2__
+    __m128 a = v.v;
+    __m128 b = right.v.v;
+    __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+    return float4(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+#else
+    return vec4(xyz().crossProduct(right.xyz()));
+#endif
+}
+
+inline vec4 vec4::reflect(vec4 n) const
+{
+    return v - float4(2.0f) * dot4(*this, n) * n.v;
+}
+#endif